@@ -0,0 +1,327 @@
+/*
+    Lightmetrica - Copyright (c) 2019 Hisanari Otsu
+    Distributed under MIT license. See LICENSE file for details.
+*/
+
+#include <lm/lm.h>
+#include <fstream>
+#include <chrono>
+#if LM_PLATFORM_WINDOWS
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <Windows.h>
+#include <Psapi.h>
+#elif LM_PLATFORM_LINUX
+#include <unistd.h>
+#include <malloc.h>
+#endif
+
+/*
+    Ray throughput benchmark of acceleration structures.
+
+    The benchmark loads an OBJ model, builds each configured acceleration structure,
+    and measures the throughput of three ray sets:
+    coherent primary rays, incoherent diffuse-bounce rays from the primary hits,
+    and shadow rays connecting pairs of the primary hits.
+    The ray sets are generated once with accel::sahbvh and shared among the structures.
+    The scene is defined again for each structure, so that the build is not skipped
+    and the memory of the previous structure is released.
+    The memory of a structure is measured as the increase of the resident set size of the process
+    by the build. The statistics reported by the structure are written as well if available.
+    The results are written as JSON.
+
+    Example:
+    $ ./lm_bench_accel config.json
+
+    The configuration is given either as a path to a JSON file or as a JSON string:
+    {
+        "obj": "./scenes/fireplace_room/fireplace_room.obj",  // OBJ model
+        "eye": [5.101118, 1.083746, -2.756308],               // Camera position
+        "lookat": [4.167568, 1.078925, -2.397892],            // Look-at position
+        "vfov": 43.001194,                                    // Vertical FoV
+        "w": 1280, "h": 720,                                  // Number of primary rays per axis
+        "repeat": 3,                                          // Number of repetitions of the measurements
+        "num_threads": 0,                                     // Number of threads. All threads if zero
+        "plugin_dir": "",                                     // Directory of plugins to load (optional)
+        "output": "",                                         // Output path. Printed to stdout if empty
+        "accels": {                                           // Accels to measure with labels (optional)
+            "accel::sahbvh": ["accel::sahbvh", {}],
+            "accel::wbvh": ["accel::wbvh", {}]
+        }
+    }
+*/
+
+namespace {
+
+using namespace lm;
+
+// Number of rays processed in a batch
+constexpr int BatchSize = 256;
+
+// Elapsed time of the function in seconds
+template <typename Func>
+double measure(const Func& func) {
+    const auto start = std::chrono::high_resolution_clock::now();
+    func();
+    const auto end = std::chrono::high_resolution_clock::now();
+    return std::chrono::duration<double>(end - start).count();
+}
+
+// Resident set size of the process in bytes. Returns nullopt if unavailable on the platform.
+std::optional<long long> residentSetSize() {
+    #if LM_PLATFORM_WINDOWS
+    PROCESS_MEMORY_COUNTERS pmc;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &pmc, sizeof(pmc))) {
+        return {};
+    }
+    return (long long)(pmc.WorkingSetSize);
+    #elif LM_PLATFORM_LINUX
+    std::ifstream in("/proc/self/statm");
+    long long size, resident;
+    if (!(in >> size >> resident)) {
+        return {};
+    }
+    return resident * sysconf(_SC_PAGESIZE);
+    #else
+    return {};
+    #endif
+}
+
+// Returns the memory freed by the process to the system if possible,
+// so that the freed memory is not reused by the next build unnoticed in the resident set size.
+void releaseFreedMemory() {
+    #if LM_PLATFORM_LINUX && defined(__GLIBC__)
+    malloc_trim(0);
+    #endif
+}
+
+// Finds the closest hits of the rays in parallel. Returns the number of hits.
+long long intersectAll(const Accel& accel, const std::vector<Accel::RaySegment>& rays) {
+    const long long numBatches = (rays.size() + BatchSize - 1) / BatchSize;
+    std::vector<std::vector<std::optional<Accel::Hit>>> hits(parallel::numThreads());
+    std::atomic<long long> numHits = 0;
+    parallel::foreach(numBatches, [&](long long index, int threadId) {
+        const auto start = index * BatchSize;
+        const int n = int(std::min<long long>(BatchSize, rays.size() - start));
+        auto& hs = hits[threadId];
+        hs.resize(BatchSize);
+        accel.intersectBatch(n, &rays[start], hs.data());
+        numHits += std::count_if(hs.begin(), hs.begin() + n, [](const auto& h) { return bool(h); });
+    });
+    return numHits;
+}
+
+// Checks the occlusions of the ray segments in parallel. Returns the number of occluded segments.
+long long occludedAll(const Accel& accel, const std::vector<Accel::RaySegment>& rays) {
+    const long long numBatches = (rays.size() + BatchSize - 1) / BatchSize;
+    std::atomic<long long> numOccluded = 0;
+    parallel::foreach(numBatches, [&](long long index, int) {
+        const auto start = index * BatchSize;
+        const int n = int(std::min<long long>(BatchSize, rays.size() - start));
+        bool occluded[BatchSize];
+        accel.occludedBatch(n, &rays[start], occluded);
+        numOccluded += std::count(occluded, occluded + n, true);
+    });
+    return numOccluded;
+}
+
+// Ray sets used for the measurements
+struct RaySets {
+    std::vector<Accel::RaySegment> primary;  // Coherent primary rays in scanline order
+    std::vector<Accel::RaySegment> diffuse;  // Diffuse-bounce rays from the primary hits
+    std::vector<Accel::RaySegment> shadow;   // Segments connecting pairs of the primary hits
+};
+
+// Generates the ray sets with the scene built with the reference accel
+RaySets generateRays(const Scene& scene, int w, int h) {
+    RaySets rs;
+    const Float aspect = Float(w) / h;
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            const auto ray = scene.primaryRay(Vec2((x + .5_f) / w, (y + .5_f) / h), aspect);
+            rs.primary.push_back({ ray, Eps, Inf });
+        }
+    }
+
+    // Hit points of the primary rays and the directions toward the camera
+    std::vector<std::pair<SceneInteraction, Vec3>> sps;
+    for (const auto& r : rs.primary) {
+        const auto sp = scene.intersect(r.ray, r.tmin, r.tmax);
+        if (sp && !sp->geom.infinite) {
+            sps.push_back({ *sp, -r.ray.d });
+        }
+    }
+
+    // Cosine-weighted directions on the side of the camera
+    // and the segments to the hit points chosen randomly
+    Rng rng(42);
+    for (size_t i = 0; i < sps.size(); i++) {
+        const auto& [sp, wi] = sps[i];
+        const auto& geom = sp.geom;
+        const auto [n, u, v] = geom.orthonormalBasis(wi);
+        const auto d = math::sampleCosineWeighted(rng);
+        rs.diffuse.push_back({ { geom.p, u * d.x + v * d.y + n * d.z }, Eps, Inf });
+        const auto& p2 = sps[std::min(sps.size() - 1, size_t(rng.u() * sps.size()))].first.geom.p;
+        const auto dist = glm::distance(geom.p, p2);
+        if (dist > Eps) {
+            rs.shadow.push_back({ { geom.p, (p2 - geom.p) / dist }, Eps, dist * (1_f - Eps) });
+        }
+    }
+    return rs;
+}
+
+// Defines the scene with the camera and the model of the configuration
+void defineScene(const Json& conf, int w, int h) {
+    lm::asset("film1", "film::bitmap", {
+        {"w", w},
+        {"h", h}
+    });
+    lm::asset("camera1", "camera::pinhole", {
+        {"film", lm::asset("film1")},
+        {"position", lm::json::value<Json>(conf, "eye")},
+        {"center", lm::json::value<Json>(conf, "lookat")},
+        {"up", {0,1,0}},
+        {"vfov", lm::json::value<Json>(conf, "vfov")}
+    });
+    lm::asset("obj1", "model::wavefrontobj", {{"path", lm::json::value<Json>(conf, "obj")}});
+    lm::primitive(lm::Mat4(1), {
+        {"camera", lm::asset("camera1")}
+    });
+    lm::primitive(lm::Mat4(1), {
+        {"model", lm::asset("obj1")}
+    });
+}
+
+// Default accels to measure
+Json defaultAccels() {
+    return {
+        { "accel::sahbvh", { "accel::sahbvh", Json::object() } },
+        { "accel::wbvh", { "accel::wbvh", Json::object() } },
+        { "accel::nanort", { "accel::nanort", Json::object() } },
+        { "accel::embree", { "accel::embree", Json::object() } },
+        { "accel::embreeinstanced", { "accel::embreeinstanced", Json::object() } }
+    };
+}
+
+}
+
+int main(int argc, char** argv) {
+    try {
+        if (argc < 2) {
+            std::cerr << "Usage: lm_bench_accel <config>" << std::endl;
+            return 1;
+        }
+
+        // Load configuration from a file or a JSON string
+        const std::string arg = argv[1];
+        const auto conf = [&]() -> Json {
+            if (!arg.empty() && arg[0] == '{') {
+                return Json::parse(arg);
+            }
+            std::ifstream in(arg);
+            if (!in) {
+                throw std::runtime_error(fmt::format("Failed to open configuration [path='{}']", arg));
+            }
+            return Json::parse(in);
+        }();
+        const int w = lm::json::value(conf, "w", 1280);
+        const int h = lm::json::value(conf, "h", 720);
+        const int repeat = lm::json::value(conf, "repeat", 3);
+        const auto output = lm::json::value<std::string>(conf, "output", "");
+        const auto accels = lm::json::value<Json>(conf, "accels", defaultAccels());
+
+        // Initialize the framework
+        lm::init();
+        lm::parallel::init(lm::parallel::DefaultType, {
+            {"numThreads", lm::json::value(conf, "num_threads", 0)}
+        });
+        if (const auto dir = lm::json::value<std::string>(conf, "plugin_dir", ""); !dir.empty()) {
+            lm::comp::loadPluginDirectory(dir);
+        }
+        lm::info();
+
+        // Generate the ray sets with the reference accel
+        defineScene(conf, w, h);
+        lm::build("accel::sahbvh");
+        const auto* scene = lm::comp::get<lm::Scene>("$.scene");
+        const auto rays = generateRays(*scene, w, h);
+
+        // Measure the accels
+        Json result = {
+            {"obj", conf["obj"]},
+            {"num_threads", lm::parallel::numThreads()},
+            {"rays", {
+                {"primary", rays.primary.size()},
+                {"diffuse", rays.diffuse.size()},
+                {"shadow", rays.shadow.size()}
+            }},
+            {"accels", Json::object()}
+        };
+        for (const auto& [label, entry] : accels.items()) {
+            const auto name = entry.at(0).get<std::string>();
+            const auto params = entry.size() > 1 ? entry.at(1) : Json::object();
+            LM_INFO("Measuring [label='{}']", label);
+            LM_INDENT();
+
+            // Build in the scene defined again
+            lm::reset();
+            defineScene(conf, w, h);
+            releaseFreedMemory();
+            const auto rssBefore = residentSetSize();
+            const double buildTime = measure([&]() { lm::build(name, params); });
+            const auto rssAfter = residentSetSize();
+            const auto* accel = lm::comp::get<lm::Accel>("$.scene.accel");
+            if (!accel) {
+                LM_WARN("Skipped unavailable accel [name='{}']", name);
+                continue;
+            }
+
+            // Throughput of each ray set in Mrays/s. The fastest run of the repetitions is used.
+            Json r = {
+                {"name", name},
+                {"params", params},
+                {"build_time", buildTime}
+            };
+            const auto run = [&](const std::string& set, const std::vector<Accel::RaySegment>& rs, bool shadow) {
+                double best = std::numeric_limits<double>::infinity();
+                long long hits = 0;
+                for (int i = 0; i < repeat; i++) {
+                    best = std::min(best, measure([&]() {
+                        hits = shadow ? occludedAll(*accel, rs) : intersectAll(*accel, rs);
+                    }));
+                }
+                r[set] = {
+                    {"mrays_per_sec", rs.size() / best * 1e-6},
+                    {"hits", hits}
+                };
+            };
+            run("primary", rays.primary, false);
+            run("diffuse", rays.diffuse, false);
+            run("shadow", rays.shadow, true);
+
+            // Memory in bytes by the increase of the resident set size and the statistics if the accel reports them
+            r["memory"] = rssBefore && rssAfter ? Json(std::max(0LL, *rssAfter - *rssBefore)) : Json();
+            r["stats"] = accel->underlyingValue();
+            result["accels"][label] = r;
+        }
+
+        // Output the result
+        if (output.empty()) {
+            std::cout << result.dump(4) << std::endl;
+        }
+        else {
+            std::ofstream out(output);
+            out << result.dump(4) << std::endl;
+        }
+
+        // Shutdown the framework
+        lm::shutdown();
+    }
+    catch (const std::exception& e) {
+        LM_ERROR("Runtime error: {}", e.what());
+        return 1;
+    }
+
+    return 0;
+}
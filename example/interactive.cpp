@@ -48,7 +48,7 @@ int main(int argc, char** argv) {
         lm::primitive(lm::Mat4(1), {
             {"model", lm::asset("obj1")}
         });
-        lm::build("accel::sahbvh");
+        lm::build("accel::sahbvh", {{"builder", "lbvh"}});
         lm::serialize("lm.serialized");
         #endif
 
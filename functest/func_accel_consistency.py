@@ -50,8 +50,8 @@ lm.comp.loadPlugin(os.path.join(ft.env.bin_path, 'accel_embree'))
 
 # + {"code_folding": [0]}
 # Function to build and render the image
-def build_and_render(accel):
-    lm.build(accel, {})
+def build_and_render(accel, params={}):
+    lm.build(accel, params)
     lm.asset('film_output', 'film::bitmap', {'w': 1920, 'h': 1080})
     lm.render('renderer::raycast', {
         'output': lm.asset('film_output')
@@ -61,12 +61,20 @@ def build_and_render(accel):
 
 # + {"code_folding": []}
 # Accels and scenes
-accels = ['accel::nanort', 'accel::embree', 'accel::embreeinstanced']
+accels = {
+    'accel::sahbvh (instanced)': ('accel::sahbvh', {'instanced': True}),
+    'accel::sahbvh (spatial)': ('accel::sahbvh', {'spatial': True}),
+    'accel::sahbvh (single)': ('accel::sahbvh', {'single_precision': True}),
+    'accel::wbvh': ('accel::wbvh', {}),
+    'accel::nanort': ('accel::nanort', {}),
+    'accel::embree': ('accel::embree', {}),
+    'accel::embreeinstanced': ('accel::embreeinstanced', {})
+}
 scenes = lmscene.scenes_small()
 # -
 
 # Execute rendering for each scene and accel
-rmse_df = pd.DataFrame(columns=accels, index=scenes)
+rmse_df = pd.DataFrame(columns=accels.keys(), index=scenes)
 for scene in scenes:
     print("Rendering [scene='{}']".format(scene))
     
@@ -78,9 +86,9 @@ for scene in scenes:
     ref = build_and_render('accel::sahbvh')
     
     # Check consistency for other accels
-    for accel in accels:
+    for accel, (name, params) in accels.items():
         # Render and compute a different image
-        img = build_and_render(accel)
+        img = build_and_render(name, params)
         diff = ft.rmse_pixelwised(ref, img)
         
         # Record rmse
@@ -41,27 +41,36 @@ lm.info()
 lm.comp.loadPlugin(os.path.join(ft.env.bin_path, 'accel_nanort'))
 lm.comp.loadPlugin(os.path.join(ft.env.bin_path, 'accel_embree'))
 
-accels = [
-    'accel::sahbvh',
-    'accel::nanort',
-    'accel::embree',
-    'accel::embreeinstanced'
-]
+# Accels with configurations identified by labels
+accels = {
+    'accel::sahbvh': ('accel::sahbvh', {}),
+    'accel::sahbvh (binned)': ('accel::sahbvh', {'binned': True}),
+    'accel::sahbvh (instanced)': ('accel::sahbvh', {'instanced': True}),
+    'accel::sahbvh (spatial)': ('accel::sahbvh', {'spatial': True}),
+    'accel::sahbvh (compressed)': ('accel::sahbvh', {'compressed': True}),
+    'accel::sahbvh (lbvh)': ('accel::sahbvh', {'builder': 'lbvh'}),
+    'accel::sahbvh (single)': ('accel::sahbvh', {'single_precision': True}),
+    'accel::wbvh': ('accel::wbvh', {}),
+    'accel::nanort': ('accel::nanort', {}),
+    'accel::embree': ('accel::embree', {}),
+    'accel::embreeinstanced': ('accel::embreeinstanced', {})
+}
 scenes = lmscene.scenes_small()
 
-build_time_df = pd.DataFrame(columns=accels, index=scenes)
-render_time_df = pd.DataFrame(columns=accels, index=scenes)
+build_time_df = pd.DataFrame(columns=accels.keys(), index=scenes)
+render_time_df = pd.DataFrame(columns=accels.keys(), index=scenes)
+sah_cost_df = pd.DataFrame(columns=accels.keys(), index=scenes)
 for scene in scenes:
     lm.reset()
     lmscene.load(ft.env.scene_path, scene)
-    for accel in accels:
+    for accel, (name, params) in accels.items():
         lm.asset('film_output', 'film::bitmap', {
             'w': 1920,
             'h': 1080
         })
         
         def build():
-            lm.build(accel, {})
+            lm.build(name, params)
         build_time = timeit.timeit(stmt=build, number=1)
         build_time_df[accel][scene] = build_time
 
@@ -72,6 +81,24 @@ for scene in scenes:
         render_time = timeit.timeit(stmt=render, number=1)
         render_time_df[accel][scene] = render_time
 
+        # Statistics of the structure if the accel reports them
+        stats = lm.comp.get('$.scene.accel').underlyingValue()
+        sah_cost_df[accel][scene] = stats.get('sah_cost', np.nan) if stats else np.nan
+
 build_time_df
 
 render_time_df
+
+sah_cost_df
+
+# SAH cost versus render time for the accels reporting the cost
+fig, axs = plt.subplots(1, len(scenes), figsize=(5*len(scenes), 4), squeeze=False)
+for i, scene in enumerate(scenes):
+    ax = axs[0][i]
+    for accel in accels.keys():
+        ax.scatter(sah_cost_df[accel][scene], render_time_df[accel][scene], label=accel)
+    ax.set_title(scene)
+    ax.set_xlabel('SAH cost')
+    ax.set_ylabel('Render time [s]')
+axs[0][-1].legend(bbox_to_anchor=(1.05, 1), loc='upper left')
+plt.show()
@@ -7,6 +7,7 @@
 
 #include "component.h"
 #include "math.h"
+#include <unordered_set>
 
 LM_NAMESPACE_BEGIN(LM_NAMESPACE)
 
@@ -34,10 +35,33 @@ public:
         Builds the acceleration structure from the primitives inside the given scene.
         When a primitive inside the scene is updated by addition or modification,
         you need to call the function again to update the structure.
+        The global transformations of the primitives are obtained from the primitive instances
+        of the scene (:cpp:func:`lm::Scene::primitiveInstanceAt`) flattened in :cpp:func:`lm::Scene::build`.
         \endrst
     */
     virtual void build(const Scene& scene) = 0;
 
+    /*!
+        \brief Update acceleration structure.
+        \param scene Input scene.
+        \param dirtyNodes Indices of the scene nodes modified after the last build.
+
+        \rst
+        Updates the acceleration structure built by :cpp:func:`lm::Accel::build`
+        after the modification of the scene nodes in ``dirtyNodes``,
+        e.g., change of the transformation of a group node or replacement of the mesh of a primitive node.
+        A modification of a group node affects all of its descendants.
+        The implementation can refit the existing structure or rebuild only the affected parts.
+        As with :cpp:func:`lm::Accel::build`, the primitive instances of the scene
+        are expected to be flattened again before the function is called.
+        The default implementation rebuilds the structure from scratch.
+        \endrst
+    */
+    virtual void update(const Scene& scene, const std::unordered_set<int>& dirtyNodes) {
+        LM_UNUSED(dirtyNodes);
+        build(scene);
+    }
+
     /*!
         \brief Hit result.
 
@@ -45,14 +69,21 @@ public:
         Shows information associated to the hit point of the ray.
         More additional information like surface positions can be obtained
         from querying appropriate data types from these information.
+
+        The transformations are returned as pointers to the data owned by the acceleration structure
+        to avoid copying a transformation per hit. They are valid until the structure is rebuilt or updated.
+        If the hit primitive belongs to an instance, ``globalTransform`` is the transformation
+        relative to the instance and ``instanceTransform`` is the transformation of the instance.
+        The global transformation is then the composition of them.
         \endrst
     */
     struct Hit {
-        Float t;                    //!< Distance to the hit point.
-        Vec2 uv;                    //!< Barycentric coordinates.
-        Transform globalTransform;  //!< Global transformation.
-        int primitive;              //!< Primitive node index.
-        int face;                   //!< Face index.
+        Float t;                                        //!< Distance to the hit point.
+        Vec2 uv;                                        //!< Barycentric coordinates.
+        const Transform* globalTransform;               //!< Global transformation.
+        int primitive;                                  //!< Primitive node index.
+        int face;                                       //!< Face index.
+        const Transform* instanceTransform = nullptr;   //!< Transformation of the instance if any.
     };
 
     /*!
@@ -69,6 +100,68 @@ public:
         \endrst
     */
     virtual std::optional<Hit> intersect(Ray ray, Float tmin, Float tmax) const = 0;
+
+    /*!
+        \brief Check if the ray segment is occluded.
+        \param ray Ray.
+        \param tmin Lower valid range of the ray.
+        \param tmax Higher valid range of the ray.
+
+        \rst
+        Returns true if any intersection is found in the range ``[tmin, tmax]``.
+        Unlike :cpp:func:`lm::Accel::intersect`, the implementation can terminate
+        the traversal on the first intersection found, which is suitable for shadow rays.
+        The default implementation falls back to :cpp:func:`lm::Accel::intersect`.
+        \endrst
+    */
+    virtual bool occluded(Ray ray, Float tmin, Float tmax) const {
+        return bool(intersect(ray, tmin, tmax));
+    }
+
+    /*!
+        \brief Ray segment used in the batched queries.
+    */
+    struct RaySegment {
+        Ray ray;     //!< Ray.
+        Float tmin;  //!< Lower valid range of the ray.
+        Float tmax;  //!< Higher valid range of the ray.
+    };
+
+    /*!
+        \brief Compute closest intersection points for multiple rays.
+        \param n Number of rays.
+        \param rays Array of ``n`` ray segments.
+        \param hits Array of ``n`` hits where the results are written.
+
+        \rst
+        Batched version of :cpp:func:`lm::Accel::intersect`.
+        Submitting many rays at once allows the implementation to amortize
+        the cost of the function calls or to process the rays together.
+        The default implementation calls :cpp:func:`lm::Accel::intersect` for each ray.
+        \endrst
+    */
+    virtual void intersectBatch(int n, const RaySegment* rays, std::optional<Hit>* hits) const {
+        for (int i = 0; i < n; i++) {
+            hits[i] = intersect(rays[i].ray, rays[i].tmin, rays[i].tmax);
+        }
+    }
+
+    /*!
+        \brief Check occlusions of multiple ray segments.
+        \param n Number of rays.
+        \param rays Array of ``n`` ray segments.
+        \param occluded Array of ``n`` flags where the results are written.
+
+        \rst
+        Batched version of :cpp:func:`lm::Accel::occluded`.
+        The default implementation calls :cpp:func:`lm::Accel::occluded` for each ray.
+        \endrst
+    */
+    virtual void occludedBatch(int n, const RaySegment* rays, bool* occluded) const {
+        for (int i = 0; i < n; i++) {
+            occluded[i] = this->occluded(rays[i].ray, rays[i].tmin, rays[i].tmax);
+        }
+    }
 };
 
 /*!
@@ -30,6 +30,29 @@ struct LightRaySample {
     Vec3 weight;          //!< Contribution divided by probability.
 };
 
+/*!
+    \brief Bound of an emitter.
+
+    \rst
+    This structure represents the spatial and directional bound of an emitter,
+    which is used to construct the light hierarchy of the scene.
+    The normals of the emitter are bounded by the cone around ``axis`` with the spread ``cosThetaO``,
+    and the emission around each normal is bounded by the spread ``cosThetaE``.
+    \endrst
+*/
+struct LightBound {
+    Bound bound;        //!< Bound of the emitter in world space.
+    Vec3 axis;          //!< Axis of the cone bounding the normals.
+    Float cosThetaO;    //!< Cosine of the spread angle of the normals around the axis.
+    Float cosThetaE;    //!< Cosine of the spread angle of the emission around the normals.
+    Float power;        //!< Power of the emitter.
+
+    template <typename Archive>
+    void serialize(Archive& ar) {
+        ar(bound, axis, cosThetaO, cosThetaE, power);
+    }
+};
+
 /*!
     \brief Light.
 
@@ -99,6 +122,73 @@ public:
     */
     virtual bool isInfinite() const = 0;
 
+    /*!
+        \brief Compute power of the light.
+        \param transform Transformation of the light source.
+
+        \rst
+        This function computes the power (flux) emitted by the light source
+        with the transformation ``transform``, which is used to select the light sources
+        in proportion to their contributions.
+        The power is evaluated with the maximum component of the luminance.
+        For infinite distant light, the function returns the power received by a unit disk
+        perpendicular to each direction, that is, :math:`\pi\int L_e(\omega) d\omega`.
+        The caller is responsible for scaling it by the squared radius of the scene.
+        \endrst
+    */
+    virtual Float power(const Transform& transform) const = 0;
+
+    /*!
+        \brief Get number of emitter elements.
+
+        \rst
+        A light source can be decomposed into elements, e.g., triangles of an area light,
+        which are sampled individually via the light hierarchy of the scene.
+        This function returns zero if the light does not support the decomposition.
+        \endrst
+    */
+    virtual int numElements() const { return 0; }
+
+    /*!
+        \brief Compute bound of an emitter element.
+        \param i Element index.
+        \param transform Transformation of the light source.
+    */
+    virtual LightBound elementBound(int i, const Transform& transform) const {
+        LM_UNUSED(i, transform);
+        LM_UNREACHABLE_RETURN();
+    }
+
+    /*!
+        \brief Sample a position on an emitter element.
+        \param rng Random number generator.
+        \param geom Point geometry on the scene surface.
+        \param transform Transformation of the light source.
+        \param i Element index.
+
+        \rst
+        This function is same as :cpp:func:`lm::Light::sample` except that the position
+        is sampled only from the element ``i``.
+        \endrst
+    */
+    virtual std::optional<LightRaySample> sampleElement(Rng& rng, const PointGeometry& geom, const Transform& transform, int i) const {
+        LM_UNUSED(rng, geom, transform, i);
+        LM_UNREACHABLE_RETURN();
+    }
+
+    /*!
+        \brief Evaluate pdf for sampling an emitter element in projected solid angle measure.
+        \param geom Point geometry on the scene surface.
+        \param geomL Point geometry on the light source.
+        \param transform Transformation of the light source.
+        \param i Element index.
+        \param wo Outgoing direction from the point of the light source.
+    */
+    virtual Float pdfElement(const PointGeometry& geom, const PointGeometry& geomL, const Transform& transform, int i, Vec3 wo) const {
+        LM_UNUSED(geom, geomL, transform, i, wo);
+        LM_UNREACHABLE_RETURN();
+    }
+
     /*!
         \brief Evaluate luminance.
         \param geom Point geometry on the light source.
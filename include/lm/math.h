@@ -355,6 +355,254 @@ struct Dist2 {
     }
 };
 
+// ----------------------------------------------------------------------------
+
+/*!
+    \brief 1d discrete distribution with constant-time sampling.
+
+    \rst
+    The interface is same as :cpp:class:`lm::Dist`, but the distribution is sampled
+    in constant time with the alias method by Walker [Walker1977]_.
+    The table is constructed in linear time with the algorithm by Vose [Vose1991]_.
+    If the sum of the values is zero, the distribution falls back to the uniform distribution.
+
+    .. [Walker1977] A. J. Walker.
+                    An Efficient Method for Generating Discrete Random Variables with General Distributions.
+                    ACM Transactions on Mathematical Software. 3(3):253--256. 1977.
+    .. [Vose1991] M. D. Vose.
+                  A Linear Algorithm for Generating Random Numbers with a Given Distribution.
+                  IEEE Transactions on Software Engineering. 17(9):972--975. 1991.
+    \endrst
+*/
+struct AliasDist {
+    //! Entry of the alias table.
+    struct Bin {
+        Float q;    //!< Probability to select the bin itself
+        int alias;  //!< Index selected with probability 1-q
+    };
+
+    std::vector<Float> ps;  // Pmf. Values before normalization
+    std::vector<Bin> bins;  // Alias table
+
+    // The distribution is serialized in the same form as lm::Dist
+    // and the alias table is constructed again on load,
+    // so that the archives are compatible with those containing lm::Dist.
+    template <typename Archive>
+    void save(Archive& ar) const {
+        Dist d;
+        for (Float v : ps) {
+            d.add(v);
+        }
+        d.serialize(ar);
+    }
+
+    template <typename Archive>
+    void load(Archive& ar) {
+        Dist d;
+        d.serialize(ar);
+        ps.clear();
+        for (int i = 0; i + 1 < int(d.c.size()); i++) {
+            ps.push_back(d.p(i));
+        }
+        norm();
+    }
+
+    /*!
+        \brief Add a value to the distribution.
+        \param v Value to be added.
+    */
+    void add(Float v) {
+        ps.push_back(v);
+    }
+
+    /*!
+        \brief Normalize the distribution and construct the alias table.
+    */
+    void norm() {
+        bins.resize(ps.size());
+        build(ps.data(), bins.data(), int(ps.size()));
+    }
+
+    /*!
+        \brief Normalize values and construct the alias table in place.
+        \param pmf Values of size ``n``, replaced with the normalized pmf.
+        \param table Alias table of size ``n`` to be constructed.
+        \param n Number of values.
+
+        \rst
+        The function is exposed to build multiple tables in a contiguous storage.
+        \endrst
+    */
+    static void build(Float* pmf, Bin* table, int n) {
+        Float sum = 0_f;
+        for (int i = 0; i < n; i++) {
+            sum += pmf[i];
+        }
+        for (int i = 0; i < n; i++) {
+            pmf[i] = sum > 0_f ? pmf[i] / sum : 1_f / n;
+        }
+
+        // Partition the bins by the scaled probabilities
+        std::vector<int> small, large;
+        for (int i = 0; i < n; i++) {
+            table[i] = { pmf[i] * n, i };
+            (table[i].q < 1_f ? small : large).push_back(i);
+        }
+
+        // Fill the remaining part of the small bin with the large bin
+        while (!small.empty() && !large.empty()) {
+            const int s = small.back();
+            const int l = large.back();
+            small.pop_back();
+            table[s].alias = l;
+            table[l].q -= 1_f - table[s].q;
+            if (table[l].q < 1_f) {
+                large.pop_back();
+                small.push_back(l);
+            }
+        }
+
+        // Remaining bins are selected with probability one up to rounding error
+        for (int i : small) {
+            table[i].q = 1_f;
+        }
+        for (int i : large) {
+            table[i].q = 1_f;
+        }
+    }
+
+    /*!
+        \brief Sample an index from the alias table.
+        \param table Alias table.
+        \param n Number of bins.
+        \param u Uniform random number in [0,1).
+        \return Sampled index.
+    */
+    static int samp(const Bin* table, int n, Float u) {
+        u *= n;
+        const int i = std::min(int(u), n - 1);
+        return u - i < table[i].q ? i : table[i].alias;
+    }
+
+    /*!
+        \brief Evaluate pmf.
+        \param i Index.
+        \return Evaluated pmf.
+    */
+    Float p(int i) const {
+        return (i < 0 || i >= int(ps.size())) ? 0 : ps[i];
+    }
+
+    /*!
+        \brief Sample from the distribution.
+        \param rn Random number generator.
+        \return Sampled index.
+    */
+    int samp(Rng& rn) const {
+        return samp(bins.data(), int(bins.size()), rn.u());
+    }
+};
+
+// ----------------------------------------------------------------------------
+
+/*!
+    \brief 2d discrete distribution with constant-time sampling.
+
+    \rst
+    The interface is same as :cpp:class:`lm::Dist2`, but the rows and the marginal distribution
+    are sampled with the alias method (see :cpp:class:`lm::AliasDist`).
+    The conditional distributions of all rows are stored in a single contiguous table.
+    \endrst
+*/
+struct AliasDist2 {
+    std::vector<Float> ps;                  // Conditional pmfs of the rows (row-major)
+    std::vector<AliasDist::Bin> bins;       // Alias tables of the rows (row-major)
+    AliasDist m;                            // Marginal distribution
+    int w, h;                               // Size of the distribution
+
+    // The distribution is serialized in the same form as lm::Dist2
+    // and the alias tables are constructed again on load.
+    template <typename Archive>
+    void save(Archive& ar) const {
+        Dist2 d;
+        d.w = w;
+        d.h = h;
+        d.ds.assign(h, {});
+        for (int i = 0; i < h; i++) {
+            for (int j = 0; j < w; j++) {
+                d.ds[i].add(ps[i * w + j]);
+            }
+            d.m.add(m.p(i));
+        }
+        d.serialize(ar);
+    }
+
+    template <typename Archive>
+    void load(Archive& ar) {
+        Dist2 d;
+        d.serialize(ar);
+        w = d.w;
+        h = d.h;
+        ps.resize(w * h);
+        bins.resize(w * h);
+        m = {};
+        for (int i = 0; i < h; i++) {
+            for (int j = 0; j < w; j++) {
+                ps[i * w + j] = d.ds[i].p(j);
+            }
+            m.add(d.m.p(i));
+            AliasDist::build(&ps[i * w], &bins[i * w], w);
+        }
+        m.norm();
+    }
+
+    /*!
+        \brief Add values to the distribution.
+        \param v Values to be added.
+        \param cols Number of columns.
+        \param rows Number of rows.
+    */
+    void init(const std::vector<Float>& v, int cols, int rows) {
+        w = cols;
+        h = rows;
+        ps.assign(v.begin(), v.begin() + w * h);
+        bins.resize(w * h);
+        m = {};
+        for (int i = 0; i < h; i++) {
+            Float sum = 0_f;
+            for (int j = 0; j < w; j++) {
+                sum += ps[i * w + j];
+            }
+            m.add(sum);
+            AliasDist::build(&ps[i * w], &bins[i * w], w);
+        }
+        m.norm();
+    }
+
+    /*!
+        \brief Evaluate pmf.
+        \param u Index in column.
+        \param v Index in row.
+        \return Evaluated pmf.
+    */
+    Float p(Float u, Float v) const {
+        const int y = std::min(int(v * h), h - 1);
+        const int x = int(u * w);
+        return (x < 0 || x >= w) ? 0 : m.p(y) * ps[y * w + x] * w * h;
+    }
+
+    /*!
+        \brief Sample from the distribution.
+        \param rn Random number generator.
+        \return Sampled position.
+    */
+    Vec2 samp(Rng& rn) const {
+        const int y = m.samp(rn);
+        const int x = AliasDist::samp(&bins[y * w], w, rn.u());
+        return Vec2((x + rn.u()) / w, (y + rn.u()) / h);
+    }
+};
+
 /*!
     @}
 */
@@ -75,6 +75,35 @@ using ParallelProcessFunc = std::function<void(long long index, int threadId)>;
 */
 LM_PUBLIC_API void foreach(long long numSamples, const ParallelProcessFunc& processFunc);
 
+//! Task executed by :cpp:func:`lm::parallel::tasks`.
+using TaskFunc = std::function<void()>;
+
+/*!
+    \brief Callback function to spawn a task.
+    \param task Task to be executed.
+*/
+using SpawnTaskFunc = std::function<void(const TaskFunc& task)>;
+
+/*!
+    \brief Callback function to spawn the initial tasks.
+    \param spawn Function to spawn a task.
+*/
+using TaskGroupFunc = std::function<void(const SpawnTaskFunc& spawn)>;
+
+/*!
+    \brief Fork-join execution of tasks.
+    \param func Callback function to spawn the initial tasks.
+
+    \rst
+    The tasks spawned by ``spawn`` are executed in parallel by the threads of the parallel context,
+    thus the number of threads respects the configuration of the context.
+    The tasks can spawn further tasks with the same function, e.g., for recursive divide-and-conquer.
+    The function returns when all tasks are finished.
+    If a task throws an exception, the remaining tasks are skipped and the exception is rethrown.
+    \endrst
+*/
+LM_PUBLIC_API void tasks(const TaskGroupFunc& func);
+
 /*!
     \brief Parallel context.
     
@@ -89,6 +118,17 @@ public:
     virtual int numThreads() const = 0;
     virtual bool mainThread() const = 0;
     virtual void foreach(long long numSamples, const ParallelProcessFunc& processFunc) const = 0;
+
+    // Executes the tasks sequentially by default
+    virtual void tasks(const TaskGroupFunc& func) const {
+        std::vector<TaskFunc> queue;
+        func([&](const TaskFunc& task) { queue.push_back(task); });
+        while (!queue.empty()) {
+            const auto task = std::move(queue.back());
+            queue.pop_back();
+            task();
+        }
+    }
 };
 
 /*!
@@ -112,14 +112,16 @@ struct SceneNode {
 
     // ------------------------------------------------------------------------
 
+    // Children and local transforms of the groups are stored outside of the nodes
+    // so that the size of a node does not depend on its type.
+    // Use lm::Scene::numChildren, lm::Scene::childAt, and lm::Scene::transformAt to access them.
     struct {
-        std::vector<int> children;          //!< Child primitives.
-        bool instanced;                     //!< True if the group is an instance group.
-        std::optional<Mat4> localTransform; //!< Transformation applied to children.
+        bool instanced = false;             //!< True if the group is an instance group.
+        int transform = -1;                 //!< Index of the local transform (-1 if not available).
 
         template <typename Archive>
         void serialize(Archive& ar) {
-            ar(children, instanced, localTransform);
+            ar(instanced, transform);
         }
     } group;
 
@@ -150,16 +152,58 @@ struct SceneNode {
     /*!
         \brief Make group node.
     */
-    static SceneNode makeGroup(int index, bool instanced, std::optional<Mat4> localTransform) {
+    static SceneNode makeGroup(int index, bool instanced, int transform) {
         SceneNode p;
         p.type = SceneNodeType::Group;
         p.index = index;
         p.group.instanced = instanced;
-        p.group.localTransform = localTransform;
+        p.group.transform = transform;
         return p;
     }
 };
 
+/*!
+    \brief Primitive instance.
+
+    \rst
+    This structure represents an occurrence of a primitive node in the flattened scene graph
+    associated with the global transformation.
+    A primitive node referenced from multiple groups produces multiple instances.
+    \endrst
+*/
+struct PrimitiveInstance {
+    int node;                   //!< Primitive node index.
+    Transform globalTransform;  //!< Global transformation.
+
+    template <typename Archive>
+    void serialize(Archive& ar) {
+        ar(node, globalTransform);
+    }
+};
+
+/*!
+    \brief Hit record of a ray-scene intersection.
+
+    \rst
+    This structure represents a hit point without the shading geometry.
+    The shading geometry, i.e., position, normal, texture coordinates, and tangent vectors,
+    is computed on demand by :cpp:func:`lm::Scene::interaction`.
+    The transformations point to the data owned by the acceleration structure
+    and are valid until the scene is built again.
+    \endrst
+*/
+struct SceneHit {
+    int primitive;                                  //!< Primitive node index.
+    int face;                                       //!< Face index of the mesh. -1 if not associated with a face.
+    Float t;                                        //!< Distance to the hit point. Inf for a point at infinity.
+    Vec2 uv;                                        //!< Barycentric coordinates.
+    Vec3 d;                                         //!< Direction of the ray.
+    bool infinite;                                  //!< True if the hit is a point at infinity of the environment light.
+    bool light;                                     //!< True if the hit primitive is a light.
+    const Transform* globalTransform = nullptr;     //!< Global transformation.
+    const Transform* instanceTransform = nullptr;   //!< Transformation of the instance if any.
+};
+
 // ----------------------------------------------------------------------------
 
 /*!
@@ -225,6 +269,17 @@ public:
     */
     virtual void addChildFromModel(int parent, const std::string& modelLoc) = 0;
 
+    /*!
+        \brief Set the local transform of a group node.
+        \param nodeIndex Node index of the group.
+        \param transform Transformation applied to the children.
+
+        \rst
+        The change is reflected in the next call of :cpp:func:`lm::Scene::build`.
+        \endrst
+    */
+    virtual void setTransform(int nodeIndex, Mat4 transform) = 0;
+
     // ------------------------------------------------------------------------
 
     /*!
@@ -242,12 +297,78 @@ public:
     */
     virtual const SceneNode& nodeAt(int nodeIndex) const = 0;
 
+    /*!
+        \brief Get the number of children of a node.
+        \param nodeIndex Node index.
+
+        \rst
+        The function returns 0 for the primitive nodes.
+        \endrst
+    */
+    virtual int numChildren(int nodeIndex) const = 0;
+
+    /*!
+        \brief Get a child of a group node.
+        \param nodeIndex Node index of the group.
+        \param i Index of the child in ``[0, numChildren(nodeIndex))``.
+    */
+    virtual int childAt(int nodeIndex, int i) const = 0;
+
+    /*!
+        \brief Get a local transform of a group node.
+        \param transformIndex Index of the transform specified by ``SceneNode::group.transform``.
+    */
+    virtual const Mat4& transformAt(int transformIndex) const = 0;
+
+    /*!
+        \brief Get the number of primitive instances.
+
+        \rst
+        The scene graph is flattened into the primitive instances once in :cpp:func:`lm::Scene::build`
+        before the acceleration structure is built or updated, so that the acceleration structures can use
+        the global transformations without traversing the scene graph again.
+        The instances are ordered as the primitive nodes are visited by :cpp:func:`lm::Scene::traverseNodes`.
+        \endrst
+    */
+    virtual int numPrimitiveInstances() const = 0;
+
+    /*!
+        \brief Get a primitive instance.
+        \param index Index of the primitive instance.
+    */
+    virtual const PrimitiveInstance& primitiveInstanceAt(int index) const = 0;
+
     // ------------------------------------------------------------------------
 
     /*!
         \brief Build acceleration structure.
         \param name Name of the acceleration structure.
         \param prop Property for configuration.
+
+        \rst
+        The function also builds the distribution to select a light in light sampling.
+        The strategy is specified by ``light_selection`` property in ``prop``:
+        ``power`` (default) selects the lights in proportion to their power,
+        ``uniform`` selects the lights uniformly,
+        and ``bvh`` builds the light hierarchy [Conty2018]_ over the elements of the lights
+        (e.g., triangles of area lights) and selects an element by traversing the hierarchy
+        with the importance according to the distance and the orientation to the shading point.
+        The lights not decomposed into elements are selected in proportion to their power.
+        The other properties are passed to the acceleration structure.
+
+        The scene records the nodes added or modified since the last build,
+        including the nodes affected by the replacement of the assets.
+        If the acceleration structure and the properties are the same as the last build,
+        the function only recompiles the modified primitives,
+        rebuilds the light selection only if the lights are affected,
+        and updates the acceleration structure with :cpp:func:`lm::Accel::update`.
+        The build is skipped if nothing has changed.
+        The work done and skipped in the last build is reported by ``underlyingValue("build")``.
+
+        .. [Conty2018] A. Conty Estevez & C. Kulla.
+                       Importance Sampling of Many Lights with Adaptive Tree Splitting.
+                       Proceedings of the ACM on Computer Graphics and Interactive Techniques. 1(2):25:1--25:17. 2018.
+        \endrst
     */
     virtual void build(const std::string& name, const Json& prop) = 0;
 
@@ -257,6 +378,38 @@ public:
     virtual std::optional<SceneInteraction> intersect(
         Ray ray, Float tmin = Eps, Float tmax = Inf) const = 0;
 
+    /*!
+        \brief Compute closest intersection point without the shading geometry.
+
+        \rst
+        Unlike :cpp:func:`lm::Scene::intersect`, the function only returns the hit record
+        and defers the computation of the shading geometry to :cpp:func:`lm::Scene::interaction`.
+        This is useful when the result can be discarded, e.g., on termination of a path.
+        As with :cpp:func:`lm::Scene::intersect`, the environment light is hit when ``tmax = Inf``.
+        \endrst
+    */
+    virtual std::optional<SceneHit> intersectHit(
+        Ray ray, Float tmin = Eps, Float tmax = Inf) const = 0;
+
+    /*!
+        \brief Compute surface interaction from a hit record.
+        \param hit Hit record obtained by :cpp:func:`lm::Scene::intersectHit`.
+
+        \rst
+        ``interaction(*intersectHit(ray))`` is equivalent to ``*intersect(ray)``.
+        \endrst
+    */
+    virtual SceneInteraction interaction(const SceneHit& hit) const = 0;
+
+    /*!
+        \brief Check if the ray segment is occluded by the primitives.
+        \rst
+        Unlike :cpp:func:`lm::Scene::intersect`, the environment light is not considered
+        and the surface interaction of the hit point is not computed.
+        \endrst
+    */
+    virtual bool occluded(Ray ray, Float tmin = Eps, Float tmax = Inf) const = 0;
+
     /*!
         \brief Check if two surface points are mutually visible.
     */
@@ -272,8 +425,7 @@ public:
                     const auto d = glm::distance(sp1.geom.p, sp2.geom.p);
                     return d * (1_f - Eps);
                 }();
-            // Exclude environent light from intersection test with tmax < Inf
-            return !intersect(Ray{sp1.geom.p, wo}, Eps, tmax);
+            return !occluded(Ray{sp1.geom.p, wo}, Eps, tmax);
         };
         if (sp1.geom.infinite) {
             return visible_(sp2, sp1);
@@ -183,6 +183,7 @@ struct SceneInteraction {
     PointGeometry geom;         //!< Surface point geometry information.
     bool endpoint;              //!< True if endpoint of light path.
     bool medium;                //!< True if it is medium interaction. 
+    int face = -1;              //!< Face index of the mesh. -1 if not associated with a face.
 };
 
 /*!
@@ -122,6 +122,8 @@ LM_PUBLIC_API std::string asset(const std::string& name);
     This function internally creates and registers an acceleration structure
     used by other parts of the framework.
     You may specify the acceleration structure type by ``accel::<type>`` format.
+    The strategy of light selection can be specified by ``light_selection`` property
+    (``power``, ``uniform``, or ``bvh``). See :cpp:func:`lm::Scene::build` for detail.
     \endrst
 */
 LM_PUBLIC_API void build(const std::string& accelName, const Json& prop = {});
@@ -251,6 +253,7 @@ LM_PUBLIC_API int primitiveNode(const Json& prop);
 LM_PUBLIC_API int groupNode();
 LM_PUBLIC_API int instanceGroupNode();
 LM_PUBLIC_API int transformNode(Mat4 transform);
+LM_PUBLIC_API void setTransform(int node, Mat4 transform);
 LM_PUBLIC_API void addChild(int parent, int child);
 LM_PUBLIC_API void addChildFromModel(int parent, const std::string& modelLoc);
 
@@ -317,6 +320,7 @@ public:
     virtual int groupNode() = 0;
     virtual int instanceGroupNode() = 0;
     virtual int transformNode(Mat4 transform) = 0;
+    virtual void setTransform(int node, Mat4 transform) = 0;
     virtual void addChild(int parent, int child) = 0;
     virtual void addChildFromModel(int parent, const std::string& modelLoc) = 0;
 };
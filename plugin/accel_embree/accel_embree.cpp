@@ -66,27 +66,27 @@ public:
 
         // Flatten the scene graph and setup geometries
         LM_INFO("Flattening scene");
-        scene.traverseNodes([&](const SceneNode& node, Mat4 globalTransform) {
-            if (node.type != SceneNodeType::Primitive) {
-                return;
-            }
-            if (!node.primitive.mesh) {
-                return;
+        for (int i = 0; i < scene.numPrimitiveInstances(); i++) {
+            const auto& inst = scene.primitiveInstanceAt(i);
+            const auto* mesh = scene.nodeAt(inst.node).primitive.mesh;
+            if (!mesh) {
+                continue;
             }
 
             // Record flattened primitive
             const int flattenNodeIndex = int(flattenedNodes_.size());
-            flattenedNodes_.push_back({ Transform(globalTransform), node.index });
+            flattenedNodes_.push_back({ inst.globalTransform, inst.node });
 
             // Create triangle mesh
+            const auto& M = inst.globalTransform.M;
             auto geom = rtcNewGeometry(device_, RTC_GEOMETRY_TYPE_TRIANGLE);
-            const int numTriangles = node.primitive.mesh->numTriangles();
+            const int numTriangles = mesh->numTriangles();
             auto* vs = (glm::vec3*)rtcSetNewGeometryBuffer(geom, RTC_BUFFER_TYPE_VERTEX, 0, RTC_FORMAT_FLOAT3, sizeof(glm::vec3), numTriangles*3);
             auto* fs = (glm::uvec3*)rtcSetNewGeometryBuffer(geom, RTC_BUFFER_TYPE_INDEX, 0, RTC_FORMAT_UINT3, sizeof(glm::uvec3), numTriangles);
-            node.primitive.mesh->foreachTriangle([&](int face, const Mesh::Tri& tri) {
-                const auto p1 = globalTransform * Vec4(tri.p1.p, 1_f);
-                const auto p2 = globalTransform * Vec4(tri.p2.p, 1_f);
-                const auto p3 = globalTransform * Vec4(tri.p3.p, 1_f);
+            mesh->foreachTriangle([&](int face, const Mesh::Tri& tri) {
+                const auto p1 = M * Vec4(tri.p1.p, 1_f);
+                const auto p2 = M * Vec4(tri.p2.p, 1_f);
+                const auto p3 = M * Vec4(tri.p3.p, 1_f);
                 vs[3*face  ] = glm::vec3(p1);
                 vs[3*face+1] = glm::vec3(p2);
                 vs[3*face+2] = glm::vec3(p3);
@@ -97,50 +97,89 @@ public:
             rtcCommitGeometry(geom);
             rtcAttachGeometryByID(scene_, geom, flattenNodeIndex);
             rtcReleaseGeometry(geom);
-        });
+        }
 
         LM_INFO("Building");
         rtcCommitScene(scene_);
     }
 
-    virtual std::optional<Hit> intersect(Ray ray, Float tmin, Float tmax) const override {
-        exception::ScopedDisableFPEx guard_;
-
-        RTCIntersectContext context;
-        rtcInitIntersectContext(&context);
-
-        // Setup ray
-        RTCRayHit rayhit;
-        rayhit.ray.org_x = float(ray.o.x);
-        rayhit.ray.org_y = float(ray.o.y);
-        rayhit.ray.org_z = float(ray.o.z);
-        rayhit.ray.tnear = float(tmin);
-        rayhit.ray.dir_x = float(ray.d.x);
-        rayhit.ray.dir_y = float(ray.d.y);
-        rayhit.ray.dir_z = float(ray.d.z);
-        rayhit.ray.time = 0.f;
-        rayhit.ray.tfar = float(tmax);
-        rayhit.hit.primID = RTC_INVALID_GEOMETRY_ID;
-        rayhit.hit.geomID = RTC_INVALID_GEOMETRY_ID;
-        rayhit.hit.instID[0] = RTC_INVALID_GEOMETRY_ID;
-        
-        // Intersection query
-        rtcIntersect1(scene_, &context, &rayhit);
+private:
+    // Converts the result of the intersection query
+    std::optional<Hit> makeHit(const RTCRayHit& rayhit) const {
         if (rayhit.hit.geomID == RTC_INVALID_GEOMETRY_ID) {
             // No intersection
             return {};
         }
-        
-        // Store hit information
         const auto& fn = flattenedNodes_.at(rayhit.hit.geomID);
         return Hit{
             Float(rayhit.ray.tfar),
             Vec2(Float(rayhit.hit.u), Float(rayhit.hit.v)),
-            fn.globalTransform,
+            &fn.globalTransform,
             fn.primitive,
             int(rayhit.hit.primID)
         };
     }
+
+public:
+    virtual std::optional<Hit> intersect(Ray ray, Float tmin, Float tmax) const override {
+        exception::ScopedDisableFPEx guard_;
+
+        RTCIntersectContext context;
+        rtcInitIntersectContext(&context);
+
+        // Intersection query
+        auto rayhit = makeRTCRayHit(ray, tmin, tmax);
+        rtcIntersect1(scene_, &context, &rayhit);
+        return makeHit(rayhit);
+    }
+
+    virtual bool occluded(Ray ray, Float tmin, Float tmax) const override {
+        exception::ScopedDisableFPEx guard_;
+
+        RTCIntersectContext context;
+        rtcInitIntersectContext(&context);
+
+        // Occlusion query. tfar is set to -inf if any intersection is found.
+        auto r = makeRTCRay(ray, tmin, tmax);
+        rtcOccluded1(scene_, &context, &r);
+        return r.tfar < 0.f;
+    }
+
+    virtual void intersectBatch(int n, const RaySegment* rays, std::optional<Hit>* hits) const override {
+        exception::ScopedDisableFPEx guard_;
+
+        RTCIntersectContext context;
+        rtcInitIntersectContext(&context);
+        context.flags = RTC_INTERSECT_CONTEXT_FLAG_INCOHERENT;
+
+        // Intersection query with ray stream
+        std::vector<RTCRayHit> rayhits(n);
+        for (int i = 0; i < n; i++) {
+            rayhits[i] = makeRTCRayHit(rays[i].ray, rays[i].tmin, rays[i].tmax);
+        }
+        rtcIntersect1M(scene_, &context, rayhits.data(), unsigned(n), sizeof(RTCRayHit));
+        for (int i = 0; i < n; i++) {
+            hits[i] = makeHit(rayhits[i]);
+        }
+    }
+
+    virtual void occludedBatch(int n, const RaySegment* rays, bool* occluded) const override {
+        exception::ScopedDisableFPEx guard_;
+
+        RTCIntersectContext context;
+        rtcInitIntersectContext(&context);
+        context.flags = RTC_INTERSECT_CONTEXT_FLAG_INCOHERENT;
+
+        // Occlusion query with ray stream
+        std::vector<RTCRay> rs(n);
+        for (int i = 0; i < n; i++) {
+            rs[i] = makeRTCRay(rays[i].ray, rays[i].tmin, rays[i].tmax);
+        }
+        rtcOccluded1M(scene_, &context, rs.data(), unsigned(n), sizeof(RTCRay));
+        for (int i = 0; i < n; i++) {
+            occluded[i] = rs[i].tfar < 0.f;
+        }
+    }
 };
 
 LM_COMP_REG_IMPL(Accel_Embree, "accel::embree");
@@ -94,8 +94,8 @@ public:
             if (node.type == SceneNodeType::Group) {
                 // Apply local transform
                 Mat4 M = globalTransform;
-                if (node.group.localTransform) {
-                    M *= *node.group.localTransform;
+                if (node.group.transform >= 0) {
+                    M *= scene.transformAt(node.group.transform);
                 }
 
                 // Instance group
@@ -129,8 +129,8 @@ public:
                 }
 
                 // Normal group
-                for (int child : node.group.children) {
-                    scene.visitNode(child, std::bind(visitSceneNode, _1, M, flattenedSceneIndex, ignoreInstanceGroup));
+                for (int i = 0; i < scene.numChildren(node.index); i++) {
+                    scene.visitNode(scene.childAt(node.index, i), std::bind(visitSceneNode, _1, M, flattenedSceneIndex, ignoreInstanceGroup));
                 }
 
                 return;
@@ -212,66 +212,100 @@ public:
         scene_ = rtcscenes[0];
     }
 
-    virtual std::optional<Hit> intersect(Ray ray, Float tmin, Float tmax) const override {
-        exception::ScopedDisableFPEx guard_;
-
-        RTCIntersectContext context;
-        rtcInitIntersectContext(&context);
-
-        // --------------------------------------------------------------------
-
-        // Setup ray
-        RTCRayHit rayhit;
-        rayhit.ray.org_x = float(ray.o.x);
-        rayhit.ray.org_y = float(ray.o.y);
-        rayhit.ray.org_z = float(ray.o.z);
-        rayhit.ray.tnear = float(tmin);
-        rayhit.ray.dir_x = float(ray.d.x);
-        rayhit.ray.dir_y = float(ray.d.y);
-        rayhit.ray.dir_z = float(ray.d.z);
-        rayhit.ray.time = 0.f;
-        rayhit.ray.tfar = float(tmax);
-        rayhit.hit.primID = RTC_INVALID_GEOMETRY_ID;
-        rayhit.hit.geomID = RTC_INVALID_GEOMETRY_ID;
-        rayhit.hit.instID[0] = RTC_INVALID_GEOMETRY_ID;
-
-        // --------------------------------------------------------------------
-
-        // Intersection query
-        rtcIntersect1(scene_, &context, &rayhit);
+private:
+    // Converts the result of the intersection query
+    std::optional<Hit> makeHit(const RTCRayHit& rayhit) const {
         if (rayhit.hit.geomID == RTC_INVALID_GEOMETRY_ID) {
             // No intersection
             return {};
         }
 
-        // --------------------------------------------------------------------
-
-        // Get global transform and (unflattened) node index
+        // Get global transforms and (unflattened) node index
         // corresponding to the intersected (instanced) geometry
-        const auto [M, nodeIndex] = [&]() -> std::tuple<Mat4, int> {
+        const auto [transform, instanceTransform, nodeIndex] = [&]() -> std::tuple<const Transform*, const Transform*, int> {
             const auto instID = rayhit.hit.instID[0];
             if (instID != RTC_INVALID_GEOMETRY_ID) {
                 const auto& fn1 = flattenedScenes_.at(0).at(instID);
                 const auto& fn2 = flattenedScenes_.at(fn1.flattenedSceneIndex).at(rayhit.hit.geomID);
-                return { fn1.globalTransform.M * fn2.globalTransform.M, fn2.nodeIndex };
+                return { &fn2.globalTransform, &fn1.globalTransform, fn2.nodeIndex };
             }
             else {
                 const auto& fn = flattenedScenes_.at(0).at(rayhit.hit.geomID);
-                return { fn.globalTransform.M, fn.nodeIndex };
+                return { &fn.globalTransform, nullptr, fn.nodeIndex };
             }
         }();
 
-        // --------------------------------------------------------------------
-
         // Store hit information
         return Hit{
             Float(rayhit.ray.tfar),
             Vec2(Float(rayhit.hit.u), Float(rayhit.hit.v)),
-            Transform(M),
+            transform,
             nodeIndex,
-            int(rayhit.hit.primID)
+            int(rayhit.hit.primID),
+            instanceTransform
         };
     }
+
+public:
+    virtual std::optional<Hit> intersect(Ray ray, Float tmin, Float tmax) const override {
+        exception::ScopedDisableFPEx guard_;
+
+        RTCIntersectContext context;
+        rtcInitIntersectContext(&context);
+
+        // Intersection query
+        auto rayhit = makeRTCRayHit(ray, tmin, tmax);
+        rtcIntersect1(scene_, &context, &rayhit);
+        return makeHit(rayhit);
+    }
+
+    virtual bool occluded(Ray ray, Float tmin, Float tmax) const override {
+        exception::ScopedDisableFPEx guard_;
+
+        RTCIntersectContext context;
+        rtcInitIntersectContext(&context);
+
+        // Occlusion query. tfar is set to -inf if any intersection is found.
+        auto r = makeRTCRay(ray, tmin, tmax);
+        rtcOccluded1(scene_, &context, &r);
+        return r.tfar < 0.f;
+    }
+
+    virtual void intersectBatch(int n, const RaySegment* rays, std::optional<Hit>* hits) const override {
+        exception::ScopedDisableFPEx guard_;
+
+        RTCIntersectContext context;
+        rtcInitIntersectContext(&context);
+        context.flags = RTC_INTERSECT_CONTEXT_FLAG_INCOHERENT;
+
+        // Intersection query with ray stream
+        std::vector<RTCRayHit> rayhits(n);
+        for (int i = 0; i < n; i++) {
+            rayhits[i] = makeRTCRayHit(rays[i].ray, rays[i].tmin, rays[i].tmax);
+        }
+        rtcIntersect1M(scene_, &context, rayhits.data(), unsigned(n), sizeof(RTCRayHit));
+        for (int i = 0; i < n; i++) {
+            hits[i] = makeHit(rayhits[i]);
+        }
+    }
+
+    virtual void occludedBatch(int n, const RaySegment* rays, bool* occluded) const override {
+        exception::ScopedDisableFPEx guard_;
+
+        RTCIntersectContext context;
+        rtcInitIntersectContext(&context);
+        context.flags = RTC_INTERSECT_CONTEXT_FLAG_INCOHERENT;
+
+        // Occlusion query with ray stream
+        std::vector<RTCRay> rs(n);
+        for (int i = 0; i < n; i++) {
+            rs[i] = makeRTCRay(rays[i].ray, rays[i].tmin, rays[i].tmax);
+        }
+        rtcOccluded1M(scene_, &context, rs.data(), unsigned(n), sizeof(RTCRay));
+        for (int i = 0; i < n; i++) {
+            occluded[i] = rs[i].tfar < 0.f;
+        }
+    }
 };
 
 LM_COMP_REG_IMPL(Accel_Embree_Instanced, "accel::embreeinstanced");
@@ -6,6 +6,7 @@
 #pragma once
 
 #include <lm/logger.h>
+#include <lm/math.h>
 #include <embree3/rtcore.h>
 
 LM_NAMESPACE_BEGIN(LM_NAMESPACE)
@@ -35,4 +36,32 @@ static void handleEmbreeError(void*, RTCError code, const char* str = nullptr) {
     throw std::runtime_error(codestr);
 }
 
+// Makes embree ray for the ray segment [tmin, tmax]
+static RTCRay makeRTCRay(Ray ray, Float tmin, Float tmax) {
+    RTCRay r;
+    r.org_x = float(ray.o.x);
+    r.org_y = float(ray.o.y);
+    r.org_z = float(ray.o.z);
+    r.tnear = float(tmin);
+    r.dir_x = float(ray.d.x);
+    r.dir_y = float(ray.d.y);
+    r.dir_z = float(ray.d.z);
+    r.time = 0.f;
+    r.tfar = float(tmax);
+    r.mask = unsigned(-1);
+    r.id = 0;
+    r.flags = 0;
+    return r;
+}
+
+// Makes embree ray and hit for the intersection query
+static RTCRayHit makeRTCRayHit(Ray ray, Float tmin, Float tmax) {
+    RTCRayHit rayhit;
+    rayhit.ray = makeRTCRay(ray, tmin, tmax);
+    rayhit.hit.primID = RTC_INVALID_GEOMETRY_ID;
+    rayhit.hit.geomID = RTC_INVALID_GEOMETRY_ID;
+    rayhit.hit.instID[0] = RTC_INVALID_GEOMETRY_ID;
+    return rayhit;
+}
+
 LM_NAMESPACE_END(LM_NAMESPACE)
@@ -40,29 +40,29 @@ public:
         fs_.clear();
         flattenNodeAndFacePerTriangle_.clear();
         flattenedNodes_.clear();
-        scene.traverseNodes([&](const SceneNode& node, Mat4 globalTransform) {
-            if (node.type != SceneNodeType::Primitive) {
-                return;
-            }
-            if (!node.primitive.mesh) {
-                return;
+        for (int i = 0; i < scene.numPrimitiveInstances(); i++) {
+            const auto& inst = scene.primitiveInstanceAt(i);
+            const auto* mesh = scene.nodeAt(inst.node).primitive.mesh;
+            if (!mesh) {
+                continue;
             }
 
             // Record flattened primitive
             const int flattenNodeIndex = int(flattenedNodes_.size());
-            flattenedNodes_.push_back({ Transform(globalTransform), node.index });
+            flattenedNodes_.push_back({ inst.globalTransform, inst.node });
 
             // Triangles
-            node.primitive.mesh->foreachTriangle([&](int face, const Mesh::Tri& tri) {
-                const auto p1 = globalTransform * Vec4(tri.p1.p, 1_f);
-                const auto p2 = globalTransform * Vec4(tri.p2.p, 1_f);
-                const auto p3 = globalTransform * Vec4(tri.p3.p, 1_f);
+            const auto& M = inst.globalTransform.M;
+            mesh->foreachTriangle([&](int face, const Mesh::Tri& tri) {
+                const auto p1 = M * Vec4(tri.p1.p, 1_f);
+                const auto p2 = M * Vec4(tri.p2.p, 1_f);
+                const auto p3 = M * Vec4(tri.p3.p, 1_f);
                 vs_.insert(vs_.end(), { p1.x, p1.y, p1.z, p2.x, p2.y, p2.z, p3.x, p3.y, p3.z });
                 auto s = (unsigned int)(fs_.size());
                 fs_.insert(fs_.end(), { s, s+1, s+2 });
                 flattenNodeAndFacePerTriangle_.push_back({ flattenNodeIndex, face });
             });
-        });
+        }
 
         // Build acceleration structure
         LM_INFO("Building");
@@ -72,9 +72,9 @@ public:
         accel_.Build((unsigned int)(fs_.size() / 3), mesh, pred, options);
     }
     
-    virtual std::optional<Hit> intersect(Ray ray, Float tmin, Float tmax) const override {
-        exception::ScopedDisableFPEx guard_;
-
+private:
+    // Converts to the ray type of nanort
+    nanort::Ray<Float> makeRay(Ray ray, Float tmin, Float tmax) const {
         nanort::Ray<Float> r;
         r.org[0] = ray.o[0];
         r.org[1] = ray.o[1];
@@ -84,7 +84,14 @@ public:
         r.dir[2] = ray.d[2];
         r.min_t = tmin;
         r.max_t = tmax;
-        
+        return r;
+    }
+
+public:
+    virtual std::optional<Hit> intersect(Ray ray, Float tmin, Float tmax) const override {
+        exception::ScopedDisableFPEx guard_;
+
+        const auto r = makeRay(ray, tmin, tmax);
         nanort::TriangleIntersector<Float> intersector(vs_.data(), fs_.data(), sizeof(Float) * 3);
         nanort::TriangleIntersection<Float> isect;
         if (!accel_.Traverse(r, intersector, &isect)) {
@@ -93,7 +100,18 @@ public:
         
         const auto [node, face] = flattenNodeAndFacePerTriangle_.at(isect.prim_id);
         const auto& fn = flattenedNodes_.at(node);
-        return Hit{ isect.t, Vec2(isect.u, isect.v), fn.globalTransform, fn.primitive, face };
+        return Hit{ isect.t, Vec2(isect.u, isect.v), &fn.globalTransform, fn.primitive, face };
+    }
+
+    virtual bool occluded(Ray ray, Float tmin, Float tmax) const override {
+        exception::ScopedDisableFPEx guard_;
+
+        // nanort does not provide any-hit traversal,
+        // but we can at least skip the construction of the hit information.
+        const auto r = makeRay(ray, tmin, tmax);
+        nanort::TriangleIntersector<Float> intersector(vs_.data(), fs_.data(), sizeof(Float) * 3);
+        nanort::TriangleIntersection<Float> isect;
+        return accel_.Traverse(r, intersector, &isect);
     }
 };
 
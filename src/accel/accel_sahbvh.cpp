@@ -8,88 +8,959 @@
 #include <lm/scene.h>
 #include <lm/mesh.h>
 #include <lm/logger.h>
+#include <lm/parallel.h>
 #include <lm/exception.h>
 #include <lm/serial.h>
+#include <lm/json.h>
+#include "bvhbuilder.h"
+
+#if LM_ARCH_X64
+#include <immintrin.h>
+#define LM_SAHBVH_SSE 1
+#else
+#define LM_SAHBVH_SSE 0
+#endif
+#if LM_SAHBVH_SSE && defined(__AVX__)
+#define LM_SAHBVH_AVX 1
+#else
+#define LM_SAHBVH_AVX 0
+#endif
 
 LM_NAMESPACE_BEGIN(LM_NAMESPACE)
 
+using namespace bvh;
+
 namespace {
 
-struct FlattenedPrimitiveNode {
-    Transform globalTransform;  // Global transform of the primitive
-    int primitive;              // Primitive node index
+// Four double-precision values processed in SIMD lanes.
+// The comparison operators return masks with all bits set in the lanes where the condition holds.
+struct Float4 {
+#if LM_SAHBVH_AVX
+    __m256d v;
+
+    static Float4 load(const double* p) { return { _mm256_load_pd(p) }; }
+    static Float4 broadcast(double x) { return { _mm256_set1_pd(x) }; }
+    void store(double* p) const { _mm256_store_pd(p, v); }
+    int mask() const { return _mm256_movemask_pd(v); }
+    friend Float4 operator+(Float4 a, Float4 b) { return { _mm256_add_pd(a.v, b.v) }; }
+    friend Float4 operator-(Float4 a, Float4 b) { return { _mm256_sub_pd(a.v, b.v) }; }
+    friend Float4 operator*(Float4 a, Float4 b) { return { _mm256_mul_pd(a.v, b.v) }; }
+    friend Float4 operator/(Float4 a, Float4 b) { return { _mm256_div_pd(a.v, b.v) }; }
+    friend Float4 operator&(Float4 a, Float4 b) { return { _mm256_and_pd(a.v, b.v) }; }
+    friend Float4 operator|(Float4 a, Float4 b) { return { _mm256_or_pd(a.v, b.v) }; }
+    friend Float4 operator<=(Float4 a, Float4 b) { return { _mm256_cmp_pd(a.v, b.v, _CMP_LE_OQ) }; }
+    friend Float4 operator>=(Float4 a, Float4 b) { return { _mm256_cmp_pd(a.v, b.v, _CMP_GE_OQ) }; }
+    friend Float4 andnot(Float4 a, Float4 b) { return { _mm256_andnot_pd(a.v, b.v) }; }
+#elif LM_SAHBVH_SSE
+    __m128d v[2];
+
+    template <typename Op>
+    static Float4 apply(Float4 a, Float4 b, Op op) { return { { op(a.v[0], b.v[0]), op(a.v[1], b.v[1]) } }; }
+    static Float4 load(const double* p) { return { { _mm_load_pd(p), _mm_load_pd(p + 2) } }; }
+    static Float4 broadcast(double x) { return { { _mm_set1_pd(x), _mm_set1_pd(x) } }; }
+    void store(double* p) const { _mm_store_pd(p, v[0]); _mm_store_pd(p + 2, v[1]); }
+    int mask() const { return _mm_movemask_pd(v[0]) | (_mm_movemask_pd(v[1]) << 2); }
+    friend Float4 operator+(Float4 a, Float4 b) { return apply(a, b, [](__m128d x, __m128d y) { return _mm_add_pd(x, y); }); }
+    friend Float4 operator-(Float4 a, Float4 b) { return apply(a, b, [](__m128d x, __m128d y) { return _mm_sub_pd(x, y); }); }
+    friend Float4 operator*(Float4 a, Float4 b) { return apply(a, b, [](__m128d x, __m128d y) { return _mm_mul_pd(x, y); }); }
+    friend Float4 operator/(Float4 a, Float4 b) { return apply(a, b, [](__m128d x, __m128d y) { return _mm_div_pd(x, y); }); }
+    friend Float4 operator&(Float4 a, Float4 b) { return apply(a, b, [](__m128d x, __m128d y) { return _mm_and_pd(x, y); }); }
+    friend Float4 operator|(Float4 a, Float4 b) { return apply(a, b, [](__m128d x, __m128d y) { return _mm_or_pd(x, y); }); }
+    friend Float4 operator<=(Float4 a, Float4 b) { return apply(a, b, [](__m128d x, __m128d y) { return _mm_cmple_pd(x, y); }); }
+    friend Float4 operator>=(Float4 a, Float4 b) { return apply(a, b, [](__m128d x, __m128d y) { return _mm_cmpge_pd(x, y); }); }
+    friend Float4 andnot(Float4 a, Float4 b) { return apply(a, b, [](__m128d x, __m128d y) { return _mm_andnot_pd(x, y); }); }
+#else
+    double v[4];
+
+    template <typename Op>
+    static Float4 apply(Float4 a, Float4 b, Op op) {
+        Float4 r;
+        for (int i = 0; i < 4; i++) {
+            r.v[i] = op(a.v[i], b.v[i]);
+        }
+        return r;
+    }
+    template <typename Op>
+    static Float4 applyBits(Float4 a, Float4 b, Op op) {
+        return apply(a, b, [&](double x, double y) {
+            uint64_t bx, by;
+            std::memcpy(&bx, &x, sizeof(double));
+            std::memcpy(&by, &y, sizeof(double));
+            const uint64_t br = op(bx, by);
+            double r;
+            std::memcpy(&r, &br, sizeof(double));
+            return r;
+        });
+    }
+    template <typename Cmp>
+    static Float4 compare(Float4 a, Float4 b, Cmp cmp) {
+        return apply(a, b, [&](double x, double y) {
+            const uint64_t m = cmp(x, y) ? ~uint64_t(0) : uint64_t(0);
+            double r;
+            std::memcpy(&r, &m, sizeof(double));
+            return r;
+        });
+    }
+    static Float4 load(const double* p) { return { { p[0], p[1], p[2], p[3] } }; }
+    static Float4 broadcast(double x) { return { { x, x, x, x } }; }
+    void store(double* p) const { std::copy(v, v + 4, p); }
+    int mask() const {
+        int m = 0;
+        for (int i = 0; i < 4; i++) {
+            m |= int(std::signbit(v[i])) << i;
+        }
+        return m;
+    }
+    friend Float4 operator+(Float4 a, Float4 b) { return apply(a, b, std::plus<double>()); }
+    friend Float4 operator-(Float4 a, Float4 b) { return apply(a, b, std::minus<double>()); }
+    friend Float4 operator*(Float4 a, Float4 b) { return apply(a, b, std::multiplies<double>()); }
+    friend Float4 operator/(Float4 a, Float4 b) { return apply(a, b, std::divides<double>()); }
+    friend Float4 operator&(Float4 a, Float4 b) { return applyBits(a, b, std::bit_and<uint64_t>()); }
+    friend Float4 operator|(Float4 a, Float4 b) { return applyBits(a, b, std::bit_or<uint64_t>()); }
+    friend Float4 andnot(Float4 a, Float4 b) { return applyBits(a, b, [](uint64_t x, uint64_t y) { return ~x & y; }); }
+    friend Float4 operator<=(Float4 a, Float4 b) { return compare(a, b, [](double x, double y) { return x <= y; }); }
+    friend Float4 operator>=(Float4 a, Float4 b) { return compare(a, b, [](double x, double y) { return x >= y; }); }
+#endif
+};
+
+// Four single-precision values processed in SIMD lanes. Same interface as Float4.
+struct Float4f {
+#if LM_SAHBVH_SSE
+    __m128 v;
+
+    static Float4f load(const float* p) { return { _mm_load_ps(p) }; }
+    static Float4f broadcast(float x) { return { _mm_set1_ps(x) }; }
+    void store(float* p) const { _mm_store_ps(p, v); }
+    int mask() const { return _mm_movemask_ps(v); }
+    friend Float4f operator+(Float4f a, Float4f b) { return { _mm_add_ps(a.v, b.v) }; }
+    friend Float4f operator-(Float4f a, Float4f b) { return { _mm_sub_ps(a.v, b.v) }; }
+    friend Float4f operator*(Float4f a, Float4f b) { return { _mm_mul_ps(a.v, b.v) }; }
+    friend Float4f operator/(Float4f a, Float4f b) { return { _mm_div_ps(a.v, b.v) }; }
+    friend Float4f operator&(Float4f a, Float4f b) { return { _mm_and_ps(a.v, b.v) }; }
+    friend Float4f operator|(Float4f a, Float4f b) { return { _mm_or_ps(a.v, b.v) }; }
+    friend Float4f operator<=(Float4f a, Float4f b) { return { _mm_cmple_ps(a.v, b.v) }; }
+    friend Float4f operator>=(Float4f a, Float4f b) { return { _mm_cmpge_ps(a.v, b.v) }; }
+    friend Float4f andnot(Float4f a, Float4f b) { return { _mm_andnot_ps(a.v, b.v) }; }
+#else
+    float v[4];
+
+    template <typename Op>
+    static Float4f apply(Float4f a, Float4f b, Op op) {
+        Float4f r;
+        for (int i = 0; i < 4; i++) {
+            r.v[i] = op(a.v[i], b.v[i]);
+        }
+        return r;
+    }
+    template <typename Op>
+    static Float4f applyBits(Float4f a, Float4f b, Op op) {
+        return apply(a, b, [&](float x, float y) {
+            uint32_t bx, by;
+            std::memcpy(&bx, &x, sizeof(float));
+            std::memcpy(&by, &y, sizeof(float));
+            const uint32_t br = op(bx, by);
+            float r;
+            std::memcpy(&r, &br, sizeof(float));
+            return r;
+        });
+    }
+    template <typename Cmp>
+    static Float4f compare(Float4f a, Float4f b, Cmp cmp) {
+        return apply(a, b, [&](float x, float y) {
+            const uint32_t m = cmp(x, y) ? ~uint32_t(0) : uint32_t(0);
+            float r;
+            std::memcpy(&r, &m, sizeof(float));
+            return r;
+        });
+    }
+    static Float4f load(const float* p) { return { { p[0], p[1], p[2], p[3] } }; }
+    static Float4f broadcast(float x) { return { { x, x, x, x } }; }
+    void store(float* p) const { std::copy(v, v + 4, p); }
+    int mask() const {
+        int m = 0;
+        for (int i = 0; i < 4; i++) {
+            m |= int(std::signbit(v[i])) << i;
+        }
+        return m;
+    }
+    friend Float4f operator+(Float4f a, Float4f b) { return apply(a, b, std::plus<float>()); }
+    friend Float4f operator-(Float4f a, Float4f b) { return apply(a, b, std::minus<float>()); }
+    friend Float4f operator*(Float4f a, Float4f b) { return apply(a, b, std::multiplies<float>()); }
+    friend Float4f operator/(Float4f a, Float4f b) { return apply(a, b, std::divides<float>()); }
+    friend Float4f operator&(Float4f a, Float4f b) { return applyBits(a, b, std::bit_and<uint32_t>()); }
+    friend Float4f operator|(Float4f a, Float4f b) { return applyBits(a, b, std::bit_or<uint32_t>()); }
+    friend Float4f andnot(Float4f a, Float4f b) { return applyBits(a, b, [](uint32_t x, uint32_t y) { return ~x & y; }); }
+    friend Float4f operator<=(Float4f a, Float4f b) { return compare(a, b, [](float x, float y) { return x <= y; }); }
+    friend Float4f operator>=(Float4f a, Float4f b) { return compare(a, b, [](float x, float y) { return x >= y; }); }
+#endif
+};
+
+// Number of triangles in a block
+constexpr int BlockSize = 4;
+
+// Bound of the relative error of the intersection test in single precision.
+// The rounding errors of the operands and the operations are at most 2^-24 times their magnitudes.
+// The errors accumulate over a few operations, so the bound takes a margin of several times of the sum.
+constexpr float SinglePrecisionErrorBound = 1.f / (1 << 18);
+
+// Block of triangles stored in SoA form to check intersections with the triangles at once.
+// Unused lanes are filled with degenerated triangles, which never intersect with rays.
+// T is the type of the coordinates and F is the SIMD type processing four values of T.
+template <typename T, typename F>
+struct alignas(32) TriBlockT {
+    T p1[3][BlockSize] = {};        // One vertex of the triangles ([axis][lane])
+    T e1[3][BlockSize] = {};        // First edges incident to p1
+    T e2[3][BlockSize] = {};        // Second edges incident to p1
+    int index[BlockSize];           // Indices of the triangles. -1 for unused lanes
+
+    template <typename Archive>
+    void serialize(Archive& ar) {
+        ar(p1, e1, e2, index);
+    }
+
+    TriBlockT() {
+        std::fill(index, index + BlockSize, -1);
+    }
+
+    // Sets the triangle to the lane
+    void set(int lane, const Tri& tr, int i) {
+        for (int a = 0; a < 3; a++) {
+            p1[a][lane] = T(tr.p1[a]);
+            e1[a][lane] = T(tr.e1[a]);
+            e2[a][lane] = T(tr.e2[a]);
+        }
+        index[lane] = i;
+    }
+
+    // Checks intersection of the ray with the triangles in the block.
+    // The computation is same as Tri::isect but for all lanes at once.
+    // Returns the mask of the intersected lanes, where the values of the lanes are stored to t, u, v, and ad.
+    int test(Ray r, Float tl, Float th, F& t, F& u, F& v, F& ad) const {
+        const auto ox = F::broadcast(T(r.o.x)), oy = F::broadcast(T(r.o.y)), oz = F::broadcast(T(r.o.z));
+        const auto dx = F::broadcast(T(r.d.x)), dy = F::broadcast(T(r.d.y)), dz = F::broadcast(T(r.d.z));
+        const auto e1x = F::load(e1[0]), e1y = F::load(e1[1]), e1z = F::load(e1[2]);
+        const auto e2x = F::load(e2[0]), e2y = F::load(e2[1]), e2z = F::load(e2[2]);
+        const auto px = dy*e2z - dz*e2y, py = dz*e2x - dx*e2z, pz = dx*e2y - dy*e2x;
+        const auto tx = ox - F::load(p1[0]), ty = oy - F::load(p1[1]), tz = oz - F::load(p1[2]);
+        const auto qx = ty*e1z - tz*e1y, qy = tz*e1x - tx*e1z, qz = tx*e1y - ty*e1x;
+        const auto d = e1x*px + e1y*py + e1z*pz;
+        const auto signMask = F::broadcast(T(-0.));
+        ad = andnot(signMask, d);
+        const auto s = (d & signMask) | F::broadcast(T(1));
+        u = (tx*px + ty*py + tz*pz) * s;
+        v = (dx*qx + dy*qy + dz*qz) * s;
+        t = (e2x*qx + e2y*qy + e2z*qz) / d;
+        const auto zero = F::broadcast(T(0));
+        return (
+            (ad >= F::broadcast(T(1e-8))) & (u >= zero) & (v >= zero) & (u + v <= ad) &
+            (t >= F::broadcast(T(tl))) & (t <= F::broadcast(T(th)))).mask();
+    }
+
+    // Finds the closest intersection with the triangles in the block.
+    // Returns the lane of the closest hit or -1 if not found, where the hit is stored to h.
+    int isect(Ray r, Float tl, Float th, Tri::Hit& h) const {
+        F t, u, v, ad;
+        const int m = test(r, tl, th, t, u, v, ad);
+        if (m == 0) {
+            return -1;
+        }
+
+        // Select the closest hit
+        alignas(32) T ts[BlockSize];
+        t.store(ts);
+        int mi = -1;
+        for (int i = 0; i < BlockSize; i++) {
+            if ((m & (1 << i)) && (mi < 0 || ts[i] < ts[mi])) {
+                mi = i;
+            }
+        }
+        alignas(32) T us[BlockSize], vs[BlockSize], ads[BlockSize];
+        u.store(us);
+        v.store(vs);
+        ad.store(ads);
+        h = { Float(ts[mi]), Float(us[mi] / ads[mi]), Float(vs[mi] / ads[mi]) };
+        return mi;
+    }
+
+    // Finds the candidate lanes possibly intersecting with the ray with the conservative test.
+    // The computation is same as test, but each quantity is relaxed by the bound of its error,
+    // which is proportional to the sum of the magnitudes of its terms [Higham 2002].
+    // The rounding errors of the ray origin and p1 are proportional to their magnitudes,
+    // so the magnitude of o-p1 is taken as |o|+|p1|, which accounts for the rays and triangles
+    // far from the origin. The test thus never misses the intersections found by Tri::isect.
+    // Returns the mask of the candidate lanes.
+    int candidates(Ray r, Float tl, Float th) const {
+        const auto signMask = F::broadcast(T(-0.));
+        const auto abs = [&](F x) { return andnot(signMask, x); };
+        const auto ox = F::broadcast(T(r.o.x)), oy = F::broadcast(T(r.o.y)), oz = F::broadcast(T(r.o.z));
+        const auto dx = F::broadcast(T(r.d.x)), dy = F::broadcast(T(r.d.y)), dz = F::broadcast(T(r.d.z));
+        const auto p1x = F::load(p1[0]), p1y = F::load(p1[1]), p1z = F::load(p1[2]);
+        const auto e1x = F::load(e1[0]), e1y = F::load(e1[1]), e1z = F::load(e1[2]);
+        const auto e2x = F::load(e2[0]), e2y = F::load(e2[1]), e2z = F::load(e2[2]);
+        const auto px = dy*e2z - dz*e2y, py = dz*e2x - dx*e2z, pz = dx*e2y - dy*e2x;
+        const auto tx = ox - p1x, ty = oy - p1y, tz = oz - p1z;
+        const auto qx = ty*e1z - tz*e1y, qy = tz*e1x - tx*e1z, qz = tx*e1y - ty*e1x;
+        const auto d = e1x*px + e1y*py + e1z*pz;
+        const auto ad = abs(d);
+        const auto s = (d & signMask) | F::broadcast(T(1));
+        const auto u = (tx*px + ty*py + tz*pz) * s;
+        const auto v = (dx*qx + dy*qy + dz*qz) * s;
+        const auto n = (e2x*qx + e2y*qy + e2z*qz) * s;  // Distance multiplied by ad
+
+        // Magnitudes of the terms
+        const auto adx = abs(dx), ady = abs(dy), adz = abs(dz);
+        const auto ae1x = abs(e1x), ae1y = abs(e1y), ae1z = abs(e1z);
+        const auto ae2x = abs(e2x), ae2y = abs(e2y), ae2z = abs(e2z);
+        const auto atx = abs(ox) + abs(p1x), aty = abs(oy) + abs(p1y), atz = abs(oz) + abs(p1z);
+        const auto apx = ady*ae2z + adz*ae2y, apy = adz*ae2x + adx*ae2z, apz = adx*ae2y + ady*ae2x;
+        const auto aqx = aty*ae1z + atz*ae1y, aqy = atz*ae1x + atx*ae1z, aqz = atx*ae1y + aty*ae1x;
+
+        // Bounds of the errors
+        const auto c = F::broadcast(T(SinglePrecisionErrorBound));
+        const auto errU = c * (atx*apx + aty*apy + atz*apz);
+        const auto errV = c * (adx*aqx + ady*aqy + adz*aqz);
+        const auto errD = c * (ae1x*apx + ae1y*apy + ae1z*apz);
+        const auto errN = c * (ae2x*aqx + ae2y*aqy + ae2z*aqz);
+
+        // The range of the distance is rounded outward and compared in the form multiplied by ad.
+        // The sign of d is ambiguous if ad is within the error, where the lanes are always candidates.
+        const auto inf = std::numeric_limits<T>::infinity();
+        const auto tlo = F::broadcast(std::nextafter(T(tl), -inf));
+        const auto thi = F::broadcast(std::nextafter(T(th), inf));
+        const auto zero = F::broadcast(T(0));
+        const auto ambiguous = ad <= errD;
+        const auto inside =
+            (u + errU >= zero) & (v + errV >= zero) & (u + v <= ad + errU + errV + errD) &
+            (n + errN >= tlo * (tl < 0 ? ad + errD : ad - errD)) &
+            (n - errN <= thi * (th < 0 ? ad - errD : ad + errD));
+        return ((ad + errD >= F::broadcast(T(1e-8) * (1 - SinglePrecisionErrorBound))) & (ambiguous | inside)).mask();
+    }
+};
+
+// Block of triangles in the precision of Float.
+// The SIMD lanes are selected according to the precision of Float.
+using FloatN = std::conditional_t<std::is_same_v<Float, float>, Float4f, Float4>;
+using TriBlock = TriBlockT<Float, FloatN>;
+
+// Block of triangles in single precision (single-precision mode).
+// The intersections are tested conservatively and refined with the triangles in Float.
+using TriBlockF = TriBlockT<float, Float4f>;
+
+// Incremental 64-bit FNV-1a hash
+struct Hasher {
+    uint64_t h = 14695981039346656037ull;
+
+    template <typename T>
+    void add(const T& v) {
+        static_assert(std::is_trivially_copyable_v<T>, "Type must be trivially copyable");
+        const auto* p = reinterpret_cast<const unsigned char*>(&v);
+        for (size_t i = 0; i < sizeof(T); i++) {
+            h = (h ^ p[i]) * 1099511628211ull;
+        }
+    }
+};
+
+// Version of the format of the cached structure.
+// Increment this when the layout of the serialized structure is changed.
+constexpr int CacheVersion = 6;
+
+// Range of the exponents of the cell sizes of the compressed BVH.
+// The exponents are stored in int8_t and the cell sizes must be normalized values of Float.
+constexpr int MinCellExponent = std::max(-128, std::numeric_limits<Float>::min_exponent - 1);
+constexpr int MaxCellExponent = std::min(127, std::numeric_limits<Float>::max_exponent - 1);
+
+// Computes 2^e for integer e in [MinCellExponent, MaxCellExponent]
+Float pow2(int e) {
+    return std::ldexp(1_f, e);
+}
+
+// Node of the compressed BVH.
+// The bound of a node is quantized on the grid of its parent, whose origin is the minimum of
+// the decoded bound of the parent and the cell size is a power of two per axis.
+// Since the cell size is a power of two, the decoding is exact in most cases.
+template <typename T>
+struct QuantizedNode {
+    T q[6];         // Quantized minimum and maximum coordinates of the bound
+    int8_t e[3];    // Exponents of the cell size of the grid for the children (valid only in interior nodes)
+    uint8_t axis;   // Split axis (valid only in interior nodes)
+    int offset;     // Index of the first primitive (leaf) or the second child (interior)
+    int count;      // Number of primitives. Zero for interior nodes
 
     template <typename Archive>
     void serialize(Archive& ar) {
-        ar(globalTransform, primitive);
+        ar(q, e, axis, offset, count);
+    }
+
+    // Cell size of the grid for the children
+    Vec3 cellSize() const {
+        return Vec3(pow2(e[0]), pow2(e[1]), pow2(e[2]));
+    }
+
+    // Decodes the bound with the decoded bound of the parent and the cell size of its grid
+    Bound decode(const Bound& pb, Vec3 s) const {
+        // Computed per component since vector operations of glm are not always vectorized
+        return {
+            Vec3(pb.mi.x + q[0] * s.x, pb.mi.y + q[1] * s.y, pb.mi.z + q[2] * s.z),
+            Vec3(pb.mi.x + q[3] * s.x, pb.mi.y + q[4] * s.y, pb.mi.z + q[5] * s.z)
+        };
+    }
+};
+
+// BVH with the bounds of the nodes quantized to T.
+// The structure of the tree is same as BVH.
+template <typename T>
+struct QuantizedBVH {
+    static constexpr int Q = std::numeric_limits<T>::max();
+    std::vector<QuantizedNode<T>> nodes;    // Nodes in depth-first order
+    std::vector<int> indices;               // Primitive indices
+    Bound root;                             // Bound of the root node
+
+    template <typename Archive>
+    void serialize(Archive& ar) {
+        ar(nodes, indices, root);
+    }
+
+    Bound bound() const {
+        return root;
+    }
+
+    // Quantizes the bounds of the nodes of the BVH.
+    // The quantized bounds are computed conservatively so that they contain the original bounds.
+    void compress(const BVH& bvh) {
+        const int n = int(bvh.nodes.size());
+        nodes.assign(n, {});
+        indices = bvh.indices;
+        root = bvh.bound();
+        if (n == 0) {
+            return;
+        }
+        std::vector<Bound> bs(n);   // Decoded bounds
+        bs[0] = root;
+        for (int i = 0; i < n; i++) {
+            const auto& ln = bvh.nodes[i];
+            auto& qn = nodes[i];
+            qn.offset = ln.offset;
+            qn.count = ln.count();
+            qn.axis = uint8_t(ln.axis());
+            if (qn.count > 0) {
+                continue;
+            }
+
+            // Quantize the bounds of the children per axis.
+            // The cell size is enlarged if the grid cannot cover the bounds due to rounding.
+            const int cs[2] = { i + 1, ln.offset };
+            const auto& pb = bs[i];
+            for (int a = 0; a < 3; a++) {
+                int e;
+                std::frexp((pb.ma[a] - pb.mi[a]) / Q, &e);
+                for (e = glm::clamp(e, MinCellExponent, MaxCellExponent); ; e++) {
+                    const auto s = pow2(e);
+                    bool covered = true;
+                    for (int c : cs) {
+                        const auto& cn = bvh.nodes[c];
+                        auto qmi = glm::clamp(int(std::floor((Float(cn.mi[a]) - pb.mi[a]) / s)), 0, Q);
+                        auto qma = glm::clamp(int(std::ceil((Float(cn.ma[a]) - pb.mi[a]) / s)), 0, Q);
+                        while (qmi > 0 && pb.mi[a] + qmi * s > Float(cn.mi[a])) {
+                            qmi--;
+                        }
+                        while (qma < Q && pb.mi[a] + qma * s < Float(cn.ma[a])) {
+                            qma++;
+                        }
+                        covered = covered && pb.mi[a] + qmi * s <= Float(cn.mi[a]) && pb.mi[a] + qma * s >= Float(cn.ma[a]);
+                        nodes[c].q[a] = T(qmi);
+                        nodes[c].q[3 + a] = T(qma);
+                    }
+                    if (covered || e == MaxCellExponent) {
+                        qn.e[a] = int8_t(e);
+                        break;
+                    }
+                }
+            }
+            const auto s = qn.cellSize();
+            for (int c : cs) {
+                bs[c] = nodes[c].decode(pb, s);
+            }
+        }
+    }
+
+    // Number of primitive references in the leaves
+    size_t numReferences() const {
+        return indices.size();
+    }
+
+    // Estimated traversal cost of the tree according to SAH
+    Float sahCost(int blockSize) const {
+        if (nodes.empty()) {
+            return 0_f;
+        }
+        std::vector<Bound> bs(nodes.size());
+        bs[0] = root;
+        Float c = 0_f;
+        for (int i = 0; i < int(nodes.size()); i++) {
+            const auto& n = nodes[i];
+            c += bs[i].surfaceArea() * (n.count > 0 ? (n.count + blockSize - 1) / blockSize : 1);
+            if (n.count == 0) {
+                const auto s = n.cellSize();
+                bs[i + 1] = nodes[i + 1].decode(bs[i], s);
+                bs[n.offset] = nodes[n.offset].decode(bs[i], s);
+            }
+        }
+        return c / root.surfaceArea();
     }
+
+    // Traverses the nodes intersecting with the ray in the same way as BVH::traverse.
+    // The bounds of the children are decoded when the parent is visited.
+    template <typename ProcessLeaf>
+    int traverse(Ray ray, Float tmin, const Float& tmax, const ProcessLeaf& processLeaf) const {
+        const auto invd = 1_f / ray.d;
+        if (nodes.empty() || !isectBound(root, ray.o, invd, tmin, tmax)) {
+            return 0;
+        }
+        // Entry of the traversal stack.
+        // The bound is stored as vectors to avoid the initialization of the stack.
+        struct Entry {
+            int index;      // Node index
+            Vec3 mi, ma;    // Decoded bound of the node
+        };
+        Entry s[MaxDepth];
+        int si = 0;
+        int ni = 0;
+        Bound nb = root;
+        int visited = 0;
+        while (true) {
+            const auto& n = nodes[ni];
+            visited++;
+            if (n.count == 0) {
+                const auto cs = n.cellSize();
+                const int c1 = ni + 1;
+                const int c2 = n.offset;
+                const auto b1 = nodes[c1].decode(nb, cs);
+                const auto b2 = nodes[c2].decode(nb, cs);
+                const bool h1 = isectBound(b1, ray.o, invd, tmin, tmax);
+                const bool h2 = isectBound(b2, ray.o, invd, tmin, tmax);
+                if (h1 && h2) {
+                    // Visit the child near to the ray origin first
+                    if (invd[n.axis] < 0) {
+                        s[si++] = { c1, b1.mi, b1.ma };
+                        ni = c2;
+                        nb = b2;
+                    }
+                    else {
+                        s[si++] = { c2, b2.mi, b2.ma };
+                        ni = c1;
+                        nb = b1;
+                    }
+                    continue;
+                }
+                if (h1 || h2) {
+                    ni = h1 ? c1 : c2;
+                    nb = h1 ? b1 : b2;
+                    continue;
+                }
+            }
+            else if (processLeaf(n.offset, n.count)) {
+                break;
+            }
+
+            // Pop the next node, which is skipped if it is outside of the updated range
+            bool found = false;
+            while (si > 0) {
+                const auto& e = s[--si];
+                if (const Bound b{ e.mi, e.ma }; isectBound(b, ray.o, invd, tmin, tmax)) {
+                    ni = e.index;
+                    nb = b;
+                    found = true;
+                    break;
+                }
+            }
+            if (!found) {
+                break;
+            }
+        }
+        return visited;
+    }
+};
+
+// Number of primitives in the node. Zero for interior nodes
+int leafSize(const LinearNode& n) {
+    return n.count();
+}
+template <typename T>
+int leafSize(const QuantizedNode<T>& n) {
+    return n.count;
+}
+
+// Structural statistics of BVHs
+struct BVHStats {
+    long long nodes = 0;                // Number of nodes
+    long long leaves = 0;               // Number of leaf nodes
+    long long leafDepths = 0;           // Sum of the depths of the leaves
+    int maxDepth = 0;                   // Maximum depth of the leaves
+    std::vector<long long> leafSizes;   // Histogram of the number of primitives in the leaves
+
+    // Accumulates the statistics of the BVH.
+    // The first child of an interior node is the next node and the second one is given by the offset.
+    template <typename BVHType>
+    void add(const BVHType& bvh) {
+        if (bvh.nodes.empty()) {
+            return;
+        }
+        std::vector<std::pair<int, int>> stack{ { 0, 0 } };  // (node index, depth)
+        while (!stack.empty()) {
+            const auto [ni, depth] = stack.back();
+            stack.pop_back();
+            const auto& n = bvh.nodes[ni];
+            nodes++;
+            if (const int c = leafSize(n); c > 0) {
+                leaves++;
+                leafDepths += depth;
+                maxDepth = std::max(maxDepth, depth);
+                if (int(leafSizes.size()) <= c) {
+                    leafSizes.resize(c + 1);
+                }
+                leafSizes[c]++;
+            }
+            else {
+                stack.push_back({ n.offset, depth + 1 });
+                stack.push_back({ ni + 1, depth + 1 });
+            }
+        }
+    }
+
+    Json toJson() const {
+        return {
+            { "nodes", nodes },
+            { "leaves", leaves },
+            { "max_depth", maxDepth },
+            { "avg_depth", leaves > 0 ? Float(leafDepths) / leaves : 0_f },
+            { "leaf_size_histogram", leafSizes }
+        };
+    }
+};
+
+// Counters of the traversal. Each thread updates its own counters.
+struct alignas(64) TraversalCounters {
+    std::atomic<long long> rays = 0;        // Number of traced rays
+    std::atomic<long long> nodes = 0;       // Number of visited nodes
+    std::atomic<long long> triangles = 0;   // Number of tested triangles
+};
+
+// Number of visited nodes and tested triangles in the traversal of a ray
+struct RayStats {
+    int nodes = 0;
+    int triangles = 0;
 };
 
-struct Tri {
-    Vec3 p1;            // One vertex of the triangle
-    Vec3 e1, e2;        // Two edges incident to p1
-    Bound b;            // Bound of the triangle
-    Vec3 c;             // Center of the bound
+// Triangle referencing the vertices in the shared vertex buffer
+struct CompactTri {
+    int v[3];           // Indices of the vertices
     int flattenedNode;  // Index of flattened primitive associated to the triangle
     int face;           // Face index of the mesh associated to the triangle
 
     template <typename Archive>
     void serialize(Archive& ar) {
-        ar(p1, e1, e2, b, c, flattenedNode, face);
+        ar(v, flattenedNode, face);
     }
 
-    Tri() {}
+    // Checks intersection with a ray
+    std::optional<Tri::Hit> isect(const std::vector<glm::vec3>& vs, Ray r, Float tl, Float th) const {
+        return Tri(Vec3(vs[v[0]]), Vec3(vs[v[1]]), Vec3(vs[v[2]]), flattenedNode, face).isect(r, tl, th);
+    }
+};
+
+// Bottom-level structure containing the triangles of the primitives.
+// After the build, the triangles in the leaves are packed into blocks in the order of the leaves,
+// and the leaf nodes reference the ranges of the blocks instead of the primitive indices.
+// In compressed mode, the BVH and the triangles are instead converted to the compressed representations,
+// where the bounds of the nodes are quantized and
+// the triangles reference the vertices in single precision shared in the structure.
+// In single-precision mode, the blocks are stored in single precision and only the candidates
+// found in the blocks are tested with the triangles in Float.
+struct Blas {
+    BVH bvh;                                              // BVH over triangles
+    std::vector<Tri> trs;                                 // Triangles
+    std::vector<TriBlock> blocks;                         // Blocks of triangles in the order of the leaves
+    std::vector<TriBlockF> blocksF;                       // Blocks of triangles in single precision (single-precision mode)
+    std::vector<Bound> bs;                                // Bounds of the triangles (used only in the build)
+    std::vector<FlattenedPrimitiveNode> flattenedNodes;   // Flattened primitives
+    QuantizedBVH<uint8_t> qbvh8;                          // BVH with 8-bit quantized bounds (compressed mode)
+    QuantizedBVH<uint16_t> qbvh16;                        // BVH with 16-bit quantized bounds (compressed mode)
+    std::vector<CompactTri> ctrs;                         // Triangles (compressed mode)
+    std::vector<glm::vec3> vs;                            // Shared vertices (compressed mode)
 
-    Tri(Vec3 p1, Vec3 p2, Vec3 p3, int flattenedNode, int face)
-        : p1(p1), flattenedNode(flattenedNode), face(face) {
-        e1 = p2 - p1;
-        e2 = p3 - p1;
-        b = merge(b, p1);
-        b = merge(b, p2);
-        b = merge(b, p3);
-        c = b.center();
+    template <typename Archive>
+    void serialize(Archive& ar) {
+        ar(bvh, trs, blocks, blocksF, flattenedNodes, qbvh8, qbvh16, ctrs, vs);
     }
 
-    // Hit information
-    struct Hit {
-        Float t;     // Distance to the triangle
-        Float u, v;  // Hitpoint in barycentric coordinates
-    };
+    bool compressed() const {
+        return !ctrs.empty();
+    }
 
-    // Checks intersection with a ray [Möller & Trumbore 1997]
-    std::optional<Hit> isect(Ray r, Float tl, Float th) const {
-        auto p = glm::cross(r.d, e2);
-        auto tv = r.o - p1;
-        auto q = glm::cross(tv, e1);
-        auto d = glm::dot(e1, p);
-        auto ad = glm::abs(d);
-        auto s = std::copysign(1_f, d);
-        auto u = glm::dot(tv, p) * s;
-        auto v = glm::dot(r.d, q) * s;
-        if (ad < 1e-8_f || u < 0_f || v < 0_f || u + v > ad) {
-            return {};
+    int numTriangles() const {
+        return int(compressed() ? ctrs.size() : trs.size());
+    }
+
+    // Index of flattened primitive and face index associated to the triangle
+    std::tuple<int, int> triangleInfo(int i) const {
+        if (compressed()) {
+            return { ctrs.at(i).flattenedNode, ctrs.at(i).face };
         }
-        auto t = glm::dot(e2, q) / d;
-        if (t < tl || th < t) {
-            return {};
+        return { trs.at(i).flattenedNode, trs.at(i).face };
+    }
+
+    // Calls func(bvh, isectLeaf) with the BVH and the function to intersect the triangles in a leaf
+    // of the current representation. isectLeaf(offset, count, ray, tmin, tmax, h, index) finds the closest
+    // intersection in the leaf and returns true with the hit and the triangle index if found.
+    template <typename Func>
+    decltype(auto) dispatch(const Func& func) const {
+        if (!blocksF.empty()) {
+            return func(bvh, [&](int offset, int count, Ray r, Float tl, Float th, Tri::Hit& h, int& index) {
+                bool found = false;
+                for (int i = offset; i < offset + (count + BlockSize - 1) / BlockSize; i++) {
+                    const auto& block = blocksF[i];
+                    const int m = block.candidates(r, tl, th);
+                    for (int lane = 0; m != 0 && lane < BlockSize; lane++) {
+                        if (!(m & (1 << lane))) {
+                            continue;
+                        }
+                        const int ti = block.index[lane];
+                        if (const auto hi = trs[ti].isect(r, tl, th)) {
+                            h = *hi;
+                            th = hi->t;
+                            index = ti;
+                            found = true;
+                        }
+                    }
+                }
+                return found;
+            });
         }
-        return Hit{ t, u / ad, v / ad };
+        if (!compressed()) {
+            return func(bvh, [&](int offset, int count, Ray r, Float tl, Float th, Tri::Hit& h, int& index) {
+                bool found = false;
+                for (int i = offset; i < offset + (count + BlockSize - 1) / BlockSize; i++) {
+                    if (const int lane = blocks[i].isect(r, tl, th, h); lane >= 0) {
+                        th = h.t;
+                        index = blocks[i].index[lane];
+                        found = true;
+                    }
+                }
+                return found;
+            });
+        }
+        const auto isectLeaf = [&](int offset, int count, Ray r, Float tl, Float th, Tri::Hit& h, int& index) {
+            const auto& indices = !qbvh8.nodes.empty() ? qbvh8.indices : qbvh16.indices;
+            bool found = false;
+            for (int i = offset; i < offset + count; i++) {
+                if (const auto hi = ctrs[indices[i]].isect(vs, r, tl, th)) {
+                    h = *hi;
+                    th = hi->t;
+                    index = indices[i];
+                    found = true;
+                }
+            }
+            return found;
+        };
+        if (!qbvh8.nodes.empty()) {
+            return func(qbvh8, isectLeaf);
+        }
+        return func(qbvh16, isectLeaf);
+    }
+
+    // Adds triangles of the primitive with the transformation.
+    // If roundToFloat is true, the vertices are rounded to single precision,
+    // e.g., so that the bounds are consistent with the single-precision vertices of the compressed structure.
+    void addPrimitive(const Mesh& mesh, const FlattenedPrimitiveNode& fn, bool roundToFloat) {
+        const int flattenNodeIndex = int(flattenedNodes.size());
+        flattenedNodes.push_back(fn);
+        mesh.foreachTriangle([&](int face, const Mesh::Tri& tri) {
+            Vec3 p1 = fn.globalTransform.M * Vec4(tri.p1.p, 1_f);
+            Vec3 p2 = fn.globalTransform.M * Vec4(tri.p2.p, 1_f);
+            Vec3 p3 = fn.globalTransform.M * Vec4(tri.p3.p, 1_f);
+            if (roundToFloat) {
+                p1 = glm::vec3(p1);
+                p2 = glm::vec3(p2);
+                p3 = glm::vec3(p3);
+            }
+            trs.emplace_back(p1, p2, p3, flattenNodeIndex, face);
+            Bound b;
+            b = merge(b, p1);
+            b = merge(b, p2);
+            b = merge(b, p3);
+            bs.push_back(b);
+        });
+    }
+
+    // Replaces the triangles of the flattened primitive in place.
+    // Returns false if the number of triangles is changed.
+    bool replacePrimitive(const Mesh& mesh, int flattenNodeIndex, int offset, int count, const Transform& globalTransform) {
+        if (mesh.numTriangles() != count) {
+            return false;
+        }
+        auto& fn = flattenedNodes[flattenNodeIndex];
+        fn.globalTransform = globalTransform;
+        mesh.foreachTriangle([&](int face, const Mesh::Tri& tri) {
+            const Vec3 p1 = fn.globalTransform.M * Vec4(tri.p1.p, 1_f);
+            const Vec3 p2 = fn.globalTransform.M * Vec4(tri.p2.p, 1_f);
+            const Vec3 p3 = fn.globalTransform.M * Vec4(tri.p3.p, 1_f);
+            trs[offset + face] = Tri(p1, p2, p3, flattenNodeIndex, face);
+        });
+        return true;
+    }
+
+    // Packs the triangles in the leaves into the blocks and updates the leaves to reference the blocks.
+    // The primitive indices are released since the blocks keep the indices of the triangles.
+    // If singlePrecision is true, the blocks are stored in single precision.
+    void pack(bool singlePrecision) {
+        if (singlePrecision) {
+            pack(blocksF);
+        }
+        else {
+            pack(blocks);
+        }
+    }
+
+    template <typename Block>
+    void pack(std::vector<Block>& bks) {
+        bks.clear();
+        for (auto& n : bvh.nodes) {
+            const int c = n.count();
+            if (c == 0) {
+                continue;
+            }
+            const int first = int(bks.size());
+            for (int i = 0; i < c; i++) {
+                if (i % BlockSize == 0) {
+                    bks.emplace_back();
+                }
+                const int ti = bvh.indices[n.offset + i];
+                bks.back().set(i % BlockSize, trs[ti], ti);
+            }
+            n.offset = first;
+        }
+        bvh.indices = std::vector<int>();
+    }
+
+    // Recomputes the bounds of the nodes keeping the topology of the tree.
+    // The triangles in the blocks are also updated.
+    // Since the children are placed after the parent, the nodes are processed in reverse order.
+    void refit() {
+        if (!blocksF.empty()) {
+            refit(blocksF);
+        }
+        else {
+            refit(blocks);
+        }
+    }
+
+    template <typename Block>
+    void refit(std::vector<Block>& bks) {
+        for (int i = int(bvh.nodes.size()) - 1; i >= 0; i--) {
+            auto& n = bvh.nodes[i];
+            Bound b;
+            if (const int c = n.count(); c > 0) {
+                for (int j = 0; j < c; j++) {
+                    auto& block = bks[n.offset + j / BlockSize];
+                    const int lane = j % BlockSize;
+                    const auto& tr = trs[block.index[lane]];
+                    block.set(lane, tr, block.index[lane]);
+                    b = merge(b, tr.p1);
+                    b = merge(b, tr.p1 + tr.e1);
+                    b = merge(b, tr.p1 + tr.e2);
+                }
+            }
+            else {
+                const auto& c1 = bvh.nodes[i + 1];
+                const auto& c2 = bvh.nodes[n.offset];
+                b = merge(Bound{ Vec3(c1.mi), Vec3(c1.ma) }, Bound{ Vec3(c2.mi), Vec3(c2.ma) });
+            }
+            n.mi = roundToFloat(b.mi, -1.f);
+            n.ma = roundToFloat(b.ma, 1.f);
+        }
+    }
+
+    // Converts the structure to the compressed representation with the bounds quantized to the given bits.
+    // The vertices are shared among the triangles if the positions are equal.
+    void compress(int bits) {
+        struct VertexHash {
+            size_t operator()(const glm::vec3& v) const {
+                Hasher h;
+                h.add(v);
+                return size_t(h.h);
+            }
+        };
+        std::unordered_map<glm::vec3, int, VertexHash> vmap;
+        ctrs.reserve(trs.size());
+        for (const auto& tr : trs) {
+            CompactTri ct{ {}, tr.flattenedNode, tr.face };
+            const glm::vec3 ps[3] = { tr.p1, tr.p1 + tr.e1, tr.p1 + tr.e2 };
+            for (int i = 0; i < 3; i++) {
+                const auto [it, inserted] = vmap.emplace(ps[i], int(vs.size()));
+                if (inserted) {
+                    vs.push_back(ps[i]);
+                }
+                ct.v[i] = it->second;
+            }
+            ctrs.push_back(ct);
+        }
+        vs.shrink_to_fit();
+        if (bits == 8) {
+            qbvh8.compress(bvh);
+        }
+        else {
+            qbvh16.compress(bvh);
+        }
+        bvh = {};
+        trs = std::vector<Tri>();
+    }
+
+    // Memory used by the structure in bytes
+    size_t memory() const {
+        return bvh.nodes.capacity() * sizeof(LinearNode) +
+            bvh.indices.capacity() * sizeof(int) +
+            trs.capacity() * sizeof(Tri) +
+            blocks.capacity() * sizeof(TriBlock) +
+            blocksF.capacity() * sizeof(TriBlockF) +
+            flattenedNodes.capacity() * sizeof(FlattenedPrimitiveNode) +
+            qbvh8.nodes.capacity() * sizeof(QuantizedNode<uint8_t>) +
+            qbvh8.indices.capacity() * sizeof(int) +
+            qbvh16.nodes.capacity() * sizeof(QuantizedNode<uint16_t>) +
+            qbvh16.indices.capacity() * sizeof(int) +
+            ctrs.capacity() * sizeof(CompactTri) +
+            vs.capacity() * sizeof(glm::vec3);
     }
 };
 
-// BVH node
-struct Node {
-    Bound b;        // Bound of the node
-    bool leaf = 0;  // True if the node is leaf
-    int s, e;       // Range of triangle indices (valid only in leaf nodes)
-    int c1, c2;     // Index to the child nodes
+// Instance of a bottom-level structure
+struct Instance {
+    Transform transform;  // Transform from the local space of the bottom-level structure to world space
+    Mat4 invM;            // Inverse of transform.M
+    int blas;             // Index of the bottom-level structure
 
     template <typename Archive>
     void serialize(Archive& ar) {
-        ar(b, leaf, s, e, c1, c2);
+        ar(transform, invM, blas);
+    }
+
+    // Transforms the ray to the local space. The distance along the ray is preserved.
+    Ray toLocal(Ray ray) const {
+        return { Vec3(invM * Vec4(ray.o, 1_f)), Vec3(invM * Vec4(ray.d, 0_f)) };
     }
 };
 
+// Primitive in the flattened scene graph
+struct FlattenedPrimitive {
+    FlattenedPrimitiveNode node;    // Flattened primitive node
+    bool dirty;                     // True if the primitive or its ancestors are modified
+};
+
+// Flattened scene graph
+struct FlattenedScene {
+    std::vector<std::vector<FlattenedPrimitive>> prims;  // Primitives per bottom-level structure
+    std::vector<Instance> instances;                     // Instances of bottom-level structures
+};
+
 }
 
 // ----------------------------------------------------------------------------
@@ -100,204 +971,671 @@ struct Node {
 
    Bounding volume hierarchy with surface area heuristics.
    
+   :param str builder: Builder of the BVHs (``sah`` or ``lbvh``). ``lbvh`` trades the quality of the tree
+                       for the build speed, which is suitable for dynamic scenes. Default value: ``sah``.
+   :param bool binned: Use binned SAH instead of full-sort SAH. Default value: false.
+   :param int bins: Number of centroid bins per axis used when ``binned`` is true.
+                    Default value: 32.
+   :param bool instanced: Build two-level BVH for instance groups. Default value: false.
+   :param bool compressed: Compress bottom-level BVHs after the build. Default value: false.
+   :param int quantization_bits: Number of bits of the quantized bounds of the nodes
+                                 when ``compressed`` is true (8 or 16). Default value: 8.
+   :param bool spatial: Use spatial splits for bottom-level BVHs. Default value: false.
+   :param float split_alpha: Spatial splits are evaluated only for the nodes whose children of the object split
+                             overlap more than this ratio of the surface area of the root. Default value: 1e-5.
+   :param float max_dup_ratio: Maximum ratio of the number of triangle references to the number of triangles
+                               when ``spatial`` is true. Default value: 1.5.
+   :param str cache_dir: Directory to cache the built structures. The structure is loaded from the cache
+                         if the geometries, transforms, and the configuration are unchanged.
+                         Disabled if empty. Default value: empty.
+   :param bool single_precision: Store the triangles in the leaves in single precision
+                                 even if the floating-point type is double.
+                                 The intersections are tested conservatively in single precision
+                                 and only the candidates are tested in double precision. Default value: false.
+   :param bool counters: Count the rays, the visited nodes, and the tested triangles in the traversal.
+                         Default value: false.
+
    Features
 
    - Parallel construction.
-   - Split axis is determined by longest axis.
-   - Split position is determined by minimum SAH cost.
-   - Uses full-sort of underlying geometries.
+   - Split axis and position are determined by minimum SAH cost.
+   - Optionally builds the BVHs by sorting the primitives by Morton codes with parallel radix sort (LBVH) [Karras2012]_.
+     The hierarchy is emitted in linear time in the number of primitives.
+     Spatial splits are not supported with this builder.
+   - Uses full-sort of underlying geometries by default.
+   - Optionally uses binned SAH [Wald2007]_ partitioning the geometries in place without sorting.
+   - Optionally uses spatial splits [Stich2009]_ clipping the triangles straddling the split planes,
+     which reduces the overlap of the nodes for long and thin triangles.
+     Object splits are found by binned SAH in this mode.
+     The SAH cost of the tree and the duplication ratio of the references are reported after the build.
+   - Optionally compresses bottom-level BVHs to reduce memory usage.
+     The bounds of the nodes are quantized relative to the bounds of the parents,
+     and the triangles reference the vertices stored in single precision shared among the triangles.
+     The compressed structures are rebuilt instead of refitted on update.
    - Uses triangle intersection by Möller and Trumbore [Möller1997]_.
+     The triangles in the leaves are packed into blocks of four in SoA form
+     and intersected at once with SIMD instructions (SSE2 or AVX if available).
+     The SAH cost of a leaf counts the blocks so that the leaves fill the blocks.
+   - The bounds of the nodes are stored in single precision rounded outward.
+     Optionally the blocks of triangles are also stored in single precision to halve the memory traffic
+     in the traversal, where the hits are refined with the triangles in double precision.
+   - Optionally builds a bottom-level BVH per instance group and a top-level BVH over the instances,
+     similar to ``accel::embreeinstanced``. The triangles of the instanced groups are stored only once.
+   - Batched queries process the rays sorted by the octants of the directions
+     and the Morton codes of the origins to improve the coherence of the traversals.
+   - Supports update of the structure. The bounds are refitted if the number of triangles is unchanged,
+     otherwise only the affected bottom-level BVHs are rebuilt.
+   - ``underlyingValue()`` returns the statistics of the structure, i.e.,
+     the numbers of the nodes and the leaves, the maximum and average depths of the leaves,
+     the histogram of the leaf sizes, the SAH cost, and the memory usage in bytes.
+     The traversal counters are also returned if ``counters`` is true,
+     which are accumulated per thread and reset on build.
 
    .. [Möller1997] T. Möller & B. Trumbore.
                    Fast, Minimum Storage Ray-Triangle Intersection.
                    Journal of Graphics Tools. 2(1):21--28. 1997.
+   .. [Wald2007] I. Wald.
+                 On fast Construction of SAH-based Bounding Volume Hierarchies.
+                 IEEE Symposium on Interactive Ray Tracing. 33--40. 2007.
+   .. [Stich2009] M. Stich, H. Friedrich & A. Dietrich.
+                  Spatial Splits in Bounding Volume Hierarchies.
+                  High Performance Graphics. 7--13. 2009.
+   .. [Karras2012] T. Karras.
+                   Maximizing Parallelism in the Construction of BVHs, Octrees, and k-d Trees.
+                   High Performance Graphics. 33--37. 2012.
 \endrst
 */
 class Accel_SAHBVH final : public Accel {
 private:
-    std::vector<Node> nodes_;                             // Nodes
-    std::vector<Tri> trs_;                                // Triangles
-    std::vector<int> indices_;                            // Triangle indices
-    std::vector<FlattenedPrimitiveNode> flattenedNodes_;  // Flattened scene graph
+    std::vector<Blas> blases_;        // Bottom-level structures (index 0: primitives not in instance groups)
+    BVH tlas_;                        // Top-level BVH over the instances (only in instanced mode)
+    std::vector<Instance> instances_; // Instances of bottom-level structures (only in instanced mode)
+    bool instanced_;                  // True to build two-level BVH
+    std::string cacheDir_;            // Directory of the cached structures. Empty if disabled
+    bool linear_;                     // True to use LBVH builder
+    bool binned_;                     // True to use binned SAH
+    int bins_;                        // Number of bins per axis
+    bool spatial_;                    // True to use spatial splits
+    Float splitAlpha_;                // Minimum overlap relative to the root to evaluate spatial splits
+    Float maxDupRatio_;               // Maximum ratio of the number of references to the triangles
+    bool compressed_;                 // True to compress bottom-level structures
+    int quantizationBits_;            // Number of bits of quantized bounds in compressed mode
+    bool singlePrecision_;            // True to store the blocks of triangles in single precision
+    MemoryCounter scratchMem_;        // Scratch memory used by the builder
+    bool counting_;                   // True to count the traversal statistics
+    mutable std::vector<TraversalCounters> counters_;  // Traversal counters per thread. Empty if disabled
     
 public:
     LM_SERIALIZE_IMPL(ar) {
-        ar(nodes_, trs_, indices_, flattenedNodes_);
+        ar(blases_, tlas_, instances_, instanced_, cacheDir_, linear_, binned_, bins_, spatial_, splitAlpha_, maxDupRatio_, compressed_, quantizationBits_, singlePrecision_);
     }
 
 public:
-    virtual void build(const Scene& scene) override {
-        // Flatten the scene graph and setup triangle list
-        LM_INFO("Flattening scene");
-        trs_.clear();
-        flattenedNodes_.clear();
-        scene.traverseNodes([&](const SceneNode& node, Mat4 globalTransform) {
-            if (node.type != SceneNodeType::Primitive) {
+    virtual bool construct(const Json& prop) override {
+        instanced_ = json::value(prop, "instanced", false);
+        cacheDir_ = json::value<std::string>(prop, "cache_dir", "");
+        const auto builder = json::value<std::string>(prop, "builder", "sah");
+        if (builder != "sah" && builder != "lbvh") {
+            LM_ERROR("Invalid builder [builder='{}']", builder);
+            return false;
+        }
+        linear_ = builder == "lbvh";
+        binned_ = json::value(prop, "binned", false);
+        bins_ = json::value(prop, "bins", 32);
+        if (bins_ < 2) {
+            LM_ERROR("Invalid number of bins [bins='{}']", bins_);
+            return false;
+        }
+        spatial_ = json::value(prop, "spatial", false);
+        splitAlpha_ = json::value(prop, "split_alpha", 1e-5_f);
+        maxDupRatio_ = json::value(prop, "max_dup_ratio", 1.5_f);
+        if (maxDupRatio_ < 1_f) {
+            LM_ERROR("Invalid maximum duplication ratio [max_dup_ratio='{}']", maxDupRatio_);
+            return false;
+        }
+        if (linear_ && spatial_) {
+            LM_ERROR("Spatial splits are not supported with LBVH builder");
+            return false;
+        }
+        compressed_ = json::value(prop, "compressed", false);
+        quantizationBits_ = json::value(prop, "quantization_bits", 8);
+        if (quantizationBits_ != 8 && quantizationBits_ != 16) {
+            LM_ERROR("Invalid number of quantization bits [quantization_bits='{}']", quantizationBits_);
+            return false;
+        }
+        singlePrecision_ = json::value(prop, "single_precision", false);
+        counting_ = json::value(prop, "counters", false);
+        return true;
+    }
+
+    virtual Json underlyingValue(const std::string& query) const override {
+        LM_UNUSED(query);
+        return stats();
+    }
+
+private:
+    // Flattens the scene graph into the primitives of bottom-level structures.
+    // Instance groups are flattened into separate structures only in instanced mode.
+    // The primitives affected by dirtyNodes are marked as dirty.
+    FlattenedScene flatten(const Scene& scene, const std::unordered_set<int>& dirtyNodes) const {
+        using namespace std::placeholders;
+        FlattenedScene flat;
+        flat.prims.emplace_back();
+
+        // Use the primitive instances flattened by the scene in non-instanced mode.
+        // The instances do not tell the modified ancestors of the primitives,
+        // so the modified transforms are found by the update by comparing the global transforms.
+        if (!instanced_) {
+            for (int i = 0; i < scene.numPrimitiveInstances(); i++) {
+                const auto& inst = scene.primitiveInstanceAt(i);
+                if (scene.nodeAt(inst.node).primitive.mesh) {
+                    flat.prims[0].push_back({ { inst.globalTransform, inst.node }, dirtyNodes.count(inst.node) > 0 });
+                }
+            }
+            return flat;
+        }
+        std::unordered_map<int, int> nodeToBlasMap;     // Node index -> index of bottom-level structure
+        using VisitSceneNodeFunc = std::function<void(const SceneNode&, Mat4, int, bool, bool)>;
+        VisitSceneNodeFunc visitSceneNode = [&](const SceneNode& node, Mat4 globalTransform, int blasIndex, bool ignoreInstanceGroup, bool dirty) {
+            dirty = dirty || dirtyNodes.count(node.index) > 0;
+
+            // Primitive node type
+            if (node.type == SceneNodeType::Primitive) {
+                if (node.primitive.mesh) {
+                    flat.prims[blasIndex].push_back({ { Transform(globalTransform), node.index }, dirty });
+                }
                 return;
             }
-            if (!node.primitive.mesh) {
+
+            // Apply local transform
+            Mat4 M = globalTransform;
+            if (node.group.transform >= 0) {
+                M *= scene.transformAt(node.group.transform);
+            }
+
+            // Instance group
+            if (instanced_ && !ignoreInstanceGroup && node.group.instanced) {
+                int childBlasIndex = -1;
+                if (auto it = nodeToBlasMap.find(node.index); it != nodeToBlasMap.end()) {
+                    childBlasIndex = it->second;
+                }
+                else {
+                    // Create a new structure if not available
+                    childBlasIndex = int(flat.prims.size());
+                    nodeToBlasMap[node.index] = childBlasIndex;
+                    flat.prims.emplace_back();
+                    scene.visitNode(node.index, std::bind(visitSceneNode, _1, Mat4(1_f), childBlasIndex, true, false));
+                }
+                flat.instances.push_back({ Transform(globalTransform), glm::inverse(globalTransform), childBlasIndex });
                 return;
             }
 
-            // Record flattened primitive
-            const int flattenNodeIndex = int(flattenedNodes_.size());
-            flattenedNodes_.push_back({ Transform(globalTransform), node.index });
+            // Normal group
+            for (int i = 0; i < scene.numChildren(node.index); i++) {
+                scene.visitNode(scene.childAt(node.index, i), std::bind(visitSceneNode, _1, M, blasIndex, ignoreInstanceGroup, dirty));
+            }
+        };
+        scene.visitNode(0, std::bind(visitSceneNode, _1, Mat4(1_f), 0, false, false));
+        if (instanced_) {
+            flat.instances.push_back({ Transform(Mat4(1_f)), Mat4(1_f), 0 });
+        }
+        return flat;
+    }
+
+    // Builds the bottom-level structure from the flattened primitives
+    size_t buildBlas(const Scene& scene, Blas& blas, const std::vector<FlattenedPrimitive>& prims) {
+        blas = {};
+        for (const auto& p : prims) {
+            blas.addPrimitive(*scene.nodeAt(p.node.primitive).primitive.mesh, p.node, compressed_);
+        }
+        BVHBuilder builder(blas.bvh, blas.bs, binned_, bins_, compressed_ ? 1 : BlockSize, scratchMem_);
+        const auto nodeMem = spatial_
+            ? builder.buildSpatial(blas.bvh, [&](int i, int axis, Float pos) {
+                return blas.trs[i].split(axis, pos);
+            }, splitAlpha_, maxDupRatio_)
+            : linear_ ? builder.buildLinear(blas.bvh) : builder.build(blas.bvh);
+        blas.bs = std::vector<Bound>();
+        if (compressed_) {
+            blas.compress(quantizationBits_);
+        }
+        else {
+            blas.pack(singlePrecision_);
+        }
+        return nodeMem;
+    }
+
+    // Builds the top-level structure over the bounds of the instances
+    size_t buildTlas(std::vector<Instance>&& instances) {
+        instances_ = std::move(instances);
+        tlas_ = {};
+        if (!instanced_) {
+            return 0;
+        }
+        instances_.erase(std::remove_if(instances_.begin(), instances_.end(), [&](const Instance& inst) {
+            return blases_[inst.blas].numTriangles() == 0;
+        }), instances_.end());
+        std::vector<Bound> bs;
+        for (const auto& inst : instances_) {
+            const auto b = blases_[inst.blas].dispatch([](const auto& bvh, const auto&) { return bvh.bound(); });
+            Bound ib;
+            for (int i = 0; i < 8; i++) {
+                const Vec3 p((i & 1) ? b.ma.x : b.mi.x, (i & 2) ? b.ma.y : b.mi.y, (i & 4) ? b.ma.z : b.mi.z);
+                ib = merge(ib, Vec3(inst.transform.M * Vec4(p, 1_f)));
+            }
+            bs.push_back(ib);
+        }
+        BVHBuilder builder(tlas_, bs, binned_, bins_, 1, scratchMem_);
+        return linear_ ? builder.buildLinear(tlas_) : builder.build(tlas_);
+    }
 
-            // Record triangles
-            node.primitive.mesh->foreachTriangle([&](int face, const Mesh::Tri& tri) {
-                const auto p1 = globalTransform * Vec4(tri.p1.p, 1_f);
-                const auto p2 = globalTransform * Vec4(tri.p2.p, 1_f);
-                const auto p3 = globalTransform * Vec4(tri.p3.p, 1_f);
-                trs_.emplace_back(p1, p2, p3, flattenNodeIndex, face);
+    // Finds the closest intersection in the bottom-level structure.
+    // Returns true and updates tmax, the hit, and the triangle index if found.
+    bool intersectBlas(const Blas& blas, Ray ray, Float tmin, Float& tmax, std::optional<Tri::Hit>& mh, int& mi, RayStats& st) const {
+        return blas.dispatch([&](const auto& bvh, const auto& isectLeaf) {
+            bool found = false;
+            st.nodes += bvh.traverse(ray, tmin, tmax, [&](int offset, int count) {
+                st.triangles += count;
+                Tri::Hit h;
+                if (isectLeaf(offset, count, ray, tmin, tmax, h, mi)) {
+                    mh = h;
+                    tmax = h.t;
+                    found = true;
+                }
+                return false;
             });
+            return found;
         });
+    }
 
-        // --------------------------------------------------------------------
+    // Checks if any triangle in the bottom-level structure intersects with the ray segment
+    bool occludedBlas(const Blas& blas, Ray ray, Float tmin, Float tmax, RayStats& st) const {
+        return blas.dispatch([&](const auto& bvh, const auto& isectLeaf) {
+            bool hit = false;
+            st.nodes += bvh.traverse(ray, tmin, tmax, [&](int offset, int count) {
+                st.triangles += count;
+                Tri::Hit h;
+                int index;
+                hit = isectLeaf(offset, count, ray, tmin, tmax, h, index);
+                return hit;
+            });
+            return hit;
+        });
+    }
 
-        const int nt = int(trs_.size()); // Number of triangles
-        struct Entry {
-            int index;
-            int start;
-            int end;
-        };
-        std::queue<Entry> q;            // Queue for traversal (node index, start, end)
-        q.push({0, 0, nt});             // Initialize the queue with root node
-        nodes_.assign(2*nt-1, {});      // Maximum number of nodes: 2*nt-1
-        indices_.assign(nt, 0);
-        std::iota(indices_.begin(), indices_.end(), 0);
-        std::mutex mu;                  // For concurrent queue
-        std::condition_variable cv;     // For concurrent queue
-        std::atomic<int> pr = 0;        // Processed triangles
-        std::atomic<int> nn = 1;        // Number of current nodes
-        bool done = 0;                  // True if the build process is done
-
-        auto process = [&]() {
-            while (!done) {
-                // Each step construct a node for the triangles ranges in [s,e)
-                auto [ni, s, e] = [&]() -> Entry {
-                    std::unique_lock<std::mutex> lk(mu);
-                    if (!done && q.empty()) {
-                        cv.wait(lk, [&]() { return done || !q.empty(); });
-                    }
-                    if (done) {
-                        return {};
-                    }
-                    auto v = q.front();
-                    q.pop();
-                    return v;
-                }();
-                if (done) {
-                    break;
-                }
+    // Memory in bytes used by the structure
+    size_t memory() const {
+        size_t mem = tlas_.nodes.capacity() * sizeof(LinearNode) +
+            tlas_.indices.capacity() * sizeof(int) +
+            instances_.capacity() * sizeof(Instance);
+        for (const auto& blas : blases_) {
+            mem += blas.memory();
+        }
+        return mem;
+    }
 
-                // Calculate the bound for the node
-                Node& n = nodes_[ni];
-                for (int i = s; i < e; i++) {
-                    n.b = merge(n.b, trs_[indices_[i]].b);
+    // Computes the statistics of the structure and the traversal counters if enabled.
+    // The SAH cost is averaged over the bottom-level structures weighted by the number of triangles.
+    Json stats() const {
+        BVHStats bs;
+        size_t nt = 0;
+        size_t nrefs = 0;
+        Float cost = 0_f;
+        for (const auto& blas : blases_) {
+            nt += blas.numTriangles();
+        }
+        for (const auto& blas : blases_) {
+            blas.dispatch([&](const auto& bvh, const auto&) {
+                bs.add(bvh);
+                nrefs += bvh.numReferences();
+                if (nt > 0) {
+                    cost += bvh.sahCost(blas.compressed() ? 1 : BlockSize) * blas.numTriangles() / nt;
                 }
+            });
+        }
+        auto st = bs.toJson();
+        st["sah_cost"] = cost;
+        st["triangles"] = nt;
+        st["references"] = nrefs;
+        st["duplication_ratio"] = nt > 0 ? Float(nrefs) / nt : 0_f;
+        st["memory"] = memory();
+        if (instanced_) {
+            BVHStats ts;
+            ts.add(tlas_);
+            st["instances"] = instances_.size();
+            st["tlas"] = ts.toJson();
+        }
+        if (!counters_.empty()) {
+            long long rays = 0, nodes = 0, triangles = 0;
+            for (const auto& c : counters_) {
+                rays += c.rays;
+                nodes += c.nodes;
+                triangles += c.triangles;
+            }
+            st["counters"] = {
+                { "rays", rays },
+                { "nodes_visited", nodes },
+                { "triangles_tested", triangles },
+                { "nodes_per_ray", rays > 0 ? Float(nodes) / rays : 0_f },
+                { "triangles_per_ray", rays > 0 ? Float(triangles) / rays : 0_f }
+            };
+        }
+        return st;
+    }
 
-                // Function to sort the triangles according to the given axis
-                auto st = [&, s = s, e = e](int ax) {
-                    auto cmp = [&](int i1, int i2) {
-                        return trs_[i1].c[ax] < trs_[i2].c[ax];
-                    };
-                    std::sort(&indices_[s], &indices_[e-1]+1, cmp);
-                };
-
-                // Function to create a leaf node
-                auto makeLeaf = [&, s = s, e = e]() {
-                    n.leaf = 1;
-                    n.s = s;
-                    n.e = e;
-                    pr += e - s;
-                    if (pr == int(trs_.size())) {
-                        std::unique_lock<std::mutex> lk(mu);
-                        done = 1;
-                        cv.notify_all();
-                    }
-                };
+    // Resets the traversal counters. A slot is allocated for each thread of the parallel context and the main thread.
+    void resetCounters() {
+        counters_ = counting_
+            ? std::vector<TraversalCounters>(std::max(1, parallel::numThreads()) + 1)
+            : std::vector<TraversalCounters>();
+    }
 
-                // Create a leaf node if the number of triangle is 1
-                if (e - s < 2) {
-                    makeLeaf();
-                    continue;
-                }
+    // Adds the statistics of a ray to the counters of the current thread if enabled.
+    // The threads are assigned to the slots in the order of the first use.
+    void recordCounters(const RayStats& st) const {
+        if (counters_.empty()) {
+            return;
+        }
+        static std::atomic<int> nextSlot = 0;
+        thread_local const int slot = nextSlot++;
+        auto& c = counters_[slot % counters_.size()];
+        c.rays.fetch_add(1, std::memory_order_relaxed);
+        c.nodes.fetch_add(st.nodes, std::memory_order_relaxed);
+        c.triangles.fetch_add(st.triangles, std::memory_order_relaxed);
+    }
 
-                // Selects a split axis and position according to SAH
-                Float b = Inf;
-                int bi = -1, ba = -1;
-                for (int a = 0; a < 3; a++) {
-                    thread_local std::vector<Float> l(nt+1), r(nt+1);
-                    st(a);
-                    Bound bl, br;
-                    for (int i = 0; i <= e - s; i++) {
-                        int j = e - s - i;
-                        l[i] = bl.surfaceArea() * i;
-                        r[j] = br.surfaceArea() * i;
-                        bl = i < e - s ? merge(bl, trs_[indices_[s+i]].b) : bl;
-                        br = j > 0 ? merge(br, trs_[indices_[s+j-1]].b) : br;
-                    }
-                    for (int i = 1; i < e - s; i++) {
-                        const auto c = 1_f + (l[i]+r[i])/n.b.surfaceArea();
-                        if (c < b) {
-                            b = c;
-                            bi = i;
-                            ba = a;
-                        }
-                    }
-                }
-                if (b > e - s) {
-                    makeLeaf();
-                    continue;
-                }
-                st(ba);
-                int m = s + bi;
-                std::unique_lock<std::mutex> lk(mu);
-                q.push({n.c1 = nn++, s, m});
-                q.push({n.c2 = nn++, m, e});
-                cv.notify_one();
+    // Computes the hash of the flattened scene and the configuration used as the key of the cache.
+    // The hash covers the vertex positions and transforms of all primitives.
+    uint64_t contentHash(const Scene& scene, const FlattenedScene& flat) const {
+        Hasher h;
+        h.add(CacheVersion);
+        h.add(instanced_);
+        h.add(linear_);
+        h.add(binned_);
+        h.add(bins_);
+        h.add(spatial_);
+        h.add(splitAlpha_);
+        h.add(maxDupRatio_);
+        h.add(compressed_);
+        h.add(quantizationBits_);
+        h.add(singlePrecision_);
+        for (const auto& prims : flat.prims) {
+            h.add(prims.size());
+            for (const auto& p : prims) {
+                h.add(p.node.primitive);
+                h.add(p.node.globalTransform.M);
+                const auto* mesh = scene.nodeAt(p.node.primitive).primitive.mesh;
+                h.add(mesh->numTriangles());
+                mesh->foreachTriangle([&](int, const Mesh::Tri& tri) {
+                    h.add(tri.p1.p);
+                    h.add(tri.p2.p);
+                    h.add(tri.p3.p);
+                });
             }
-        };
+        }
+        for (const auto& inst : flat.instances) {
+            h.add(inst.blas);
+            h.add(inst.transform.M);
+        }
+        return h.h;
+    }
+
+    // Loads the cached structure. Returns false if not available.
+    bool loadCache(const std::string& path) {
+        if (!fs::exists(path)) {
+            return false;
+        }
+        try {
+            std::ifstream is(path, std::ios::in | std::ios::binary);
+            serial::load(is, blases_, tlas_, instances_);
+        }
+        catch (const std::exception& e) {
+            LM_WARN("Failed to load cached structure [path='{}', error='{}']", path, e.what());
+            return false;
+        }
+        return true;
+    }
+
+    // Saves the structure to the cache.
+    // The file is written to a temporary file first so that other processes never read a partial file.
+    void saveCache(const std::string& path) const {
+        try {
+            fs::create_directories(fs::path(path).parent_path());
+            const auto tmpPath = path + fmt::format(".{:08x}.tmp", std::random_device()());
+            {
+                std::ofstream os(tmpPath, std::ios::out | std::ios::binary);
+                serial::save(os, blases_, tlas_, instances_);
+            }
+            fs::rename(tmpPath, path);
+        }
+        catch (const std::exception& e) {
+            LM_WARN("Failed to save cached structure [path='{}', error='{}']", path, e.what());
+        }
+    }
+
+public:
+    virtual void build(const Scene& scene) override {
+        // Flatten the scene graph
+        LM_INFO("Flattening scene");
+        auto flat = flatten(scene, {});
+        scratchMem_.curr = 0;
+        scratchMem_.peak = 0;
+        resetCounters();
+
+        // Use the cached structure if the content of the scene is unchanged
+        std::string cachePath;
+        if (!cacheDir_.empty()) {
+            const auto hash = contentHash(scene, flat);
+            cachePath = (fs::path(cacheDir_) / fmt::format("sahbvh_{:016x}.bin", hash)).string();
+            if (loadCache(cachePath)) {
+                LM_INFO("Loaded cached structure [path='{}']", cachePath);
+                return;
+            }
+        }
+
+        // --------------------------------------------------------------------
+
+        // Build bottom-level structures and top-level structure
         LM_INFO("Building");
-        std::vector<std::thread> ths(std::thread::hardware_concurrency());
-        for (auto& th : ths) {
-            th = std::thread(process);
+        size_t nodeMem = 0;  // Maximum memory used for the nodes in the build
+        size_t nt = 0;       // Number of triangles
+        blases_.assign(flat.prims.size(), {});
+        for (int i = 0; i < int(blases_.size()); i++) {
+            nodeMem = std::max(nodeMem, buildBlas(scene, blases_[i], flat.prims[i]));
+            nt += blases_[i].numTriangles();
         }
-        for (auto& th : ths) {
-            th.join();
+        nodeMem = std::max(nodeMem, buildTlas(std::move(flat.instances)));
+        if (nt == 0) {
+            LM_INFO("Empty scene");
+            return;
         }
+        if (!cachePath.empty()) {
+            LM_INFO("Saving structure to cache [path='{}']", cachePath);
+            saveCache(cachePath);
+        }
+
+        // Report memory usage
+        const auto mem = memory();
+        LM_INFO("Memory [peak='{}', current='{}', scratch='{}', triangles='{}', instances='{}']",
+            formatMB(mem + nodeMem + scratchMem_.peak),
+            formatMB(mem),
+            formatMB(scratchMem_.peak),
+            nt,
+            instances_.size());
+
+        // Report the quality of the bottom-level structures
+        const auto st = stats();
+        LM_INFO("Quality [sah_cost='{:.3f}', references='{}', duplication_ratio='{:.3f}']",
+            st["sah_cost"].get<Float>(), st["references"].get<size_t>(), st["duplication_ratio"].get<Float>());
     };
 
-    virtual std::optional<Hit> intersect(Ray ray, Float tmin, Float tmax) const override {
-        exception::ScopedDisableFPEx guard_;  // Disable floating point exceptions
-        std::optional<Tri::Hit> mh, h;
-        int mi = -1;
-        int s[99]{};
-        int si = 0;
-        while (si >= 0) {
-            auto& n = nodes_.at(s[si--]);
-            if (!n.b.isect(ray, tmin, tmax)) {
+    virtual void update(const Scene& scene, const std::unordered_set<int>& dirtyNodes) override {
+        // Flatten the scene graph and find the modified primitives.
+        // Fall back to the full build if the instance groups are changed.
+        auto flat = flatten(scene, dirtyNodes);
+        if (flat.prims.size() != blases_.size()) {
+            build(scene);
+            return;
+        }
+
+        // Update bottom-level structures
+        int refit = 0, rebuilt = 0, skipped = 0;
+        for (int i = 0; i < int(blases_.size()); i++) {
+            auto& blas = blases_[i];
+            auto& prims = flat.prims[i];
+
+            // Rebuild the structure if the primitives are added or removed
+            const bool samePrims = prims.size() == blas.flattenedNodes.size() &&
+                std::equal(prims.begin(), prims.end(), blas.flattenedNodes.begin(), [](const auto& p, const auto& fn) {
+                    return p.node.primitive == fn.primitive;
+                });
+            if (!samePrims) {
+                buildBlas(scene, blas, prims);
+                rebuilt++;
                 continue;
             }
-            if (!n.leaf) {
-                s[++si] = n.c1;
-                s[++si] = n.c2;
+
+            // The primitives are also modified if their global transforms are changed by the ancestors
+            for (int j = 0; j < int(prims.size()); j++) {
+                prims[j].dirty = prims[j].dirty || prims[j].node.globalTransform.M != blas.flattenedNodes[j].globalTransform.M;
+            }
+            if (std::none_of(prims.begin(), prims.end(), [](const auto& p) { return p.dirty; })) {
+                skipped++;
                 continue;
             }
-            for (int i = n.s; i < n.e; i++) {
-                if (h = trs_[indices_[i]].isect(ray, tmin, tmax)) {
-                    mh = h;
-                    tmax = h->t;
-                    mi = i;
+
+            // Rebuild the structure in compressed mode since refitting is not supported
+            if (compressed_) {
+                buildBlas(scene, blas, prims);
+                rebuilt++;
+                continue;
+            }
+
+            // Replace the triangles of the modified primitives and refit the tree.
+            // Rebuild the structure if the number of triangles of any primitive is changed.
+            // The triangles of a primitive are contiguous and ordered by the flattened primitives.
+            bool topologyChanged = false;
+            for (int j = 0, offset = 0; j < int(prims.size()); j++) {
+                int count = 0;
+                while (offset + count < int(blas.trs.size()) && blas.trs[offset + count].flattenedNode == j) {
+                    count++;
+                }
+                const auto& p = prims[j];
+                if (p.dirty) {
+                    const auto& mesh = *scene.nodeAt(p.node.primitive).primitive.mesh;
+                    if (!blas.replacePrimitive(mesh, j, offset, count, p.node.globalTransform)) {
+                        topologyChanged = true;
+                        break;
+                    }
                 }
+                offset += count;
             }
+            if (topologyChanged) {
+                buildBlas(scene, blas, prims);
+                rebuilt++;
+                continue;
+            }
+            blas.refit();
+            refit++;
+        }
+
+        // Rebuild top-level structure since the transforms or the bounds of the instances might be changed
+        buildTlas(std::move(flat.instances));
+        LM_INFO("Updated acceleration structure [refit='{}', rebuilt='{}', skipped='{}']", refit, rebuilt, skipped);
+    }
+
+    virtual std::optional<Hit> intersect(Ray ray, Float tmin, Float tmax) const override {
+        exception::ScopedDisableFPEx guard_;  // Disable floating point exceptions
+        std::optional<Tri::Hit> mh;
+        int mi = -1;
+        int minst = -1;
+        RayStats st;
+        if (!instanced_) {
+            intersectBlas(blases_[0], ray, tmin, tmax, mh, mi, st);
+        }
+        else {
+            st.nodes += tlas_.traverse(ray, tmin, tmax, [&](int offset, int count) {
+                for (int i = offset; i < offset + count; i++) {
+                    const int ii = tlas_.indices[i];
+                    const auto& inst = instances_[ii];
+                    if (intersectBlas(blases_[inst.blas], inst.toLocal(ray), tmin, tmax, mh, mi, st)) {
+                        minst = ii;
+                    }
+                }
+                return false;
+            });
         }
+        recordCounters(st);
         if (!mh) {
             return {};
         }
-        const auto& tr = trs_.at(indices_.at(mi));
-        const auto& fn = flattenedNodes_.at(tr.flattenedNode);
-        return Hit{ tmax, Vec2(mh->u, mh->v), fn.globalTransform, fn.primitive, tr.face };
+        const auto& blas = blases_.at(minst < 0 ? 0 : instances_.at(minst).blas);
+        const auto [flattenedNode, face] = blas.triangleInfo(mi);
+        const auto& fn = blas.flattenedNodes.at(flattenedNode);
+        const auto* instanceTransform = minst < 0 || instances_[minst].blas == 0
+            ? nullptr
+            : &instances_[minst].transform;
+        return Hit{ tmax, Vec2(mh->u, mh->v), &fn.globalTransform, fn.primitive, face, instanceTransform };
+    }
+
+    virtual bool occluded(Ray ray, Float tmin, Float tmax) const override {
+        exception::ScopedDisableFPEx guard_;
+        RayStats st;
+        bool hit = false;
+        if (!instanced_) {
+            hit = occludedBlas(blases_[0], ray, tmin, tmax, st);
+        }
+        else {
+            st.nodes += tlas_.traverse(ray, tmin, tmax, [&](int offset, int count) {
+                for (int i = offset; i < offset + count; i++) {
+                    const auto& inst = instances_[tlas_.indices[i]];
+                    if (occludedBlas(blases_[inst.blas], inst.toLocal(ray), tmin, tmax, st)) {
+                        hit = true;
+                        return true;
+                    }
+                }
+                return false;
+            });
+        }
+        recordCounters(st);
+        return hit;
+    }
+
+private:
+    // Orders the rays of a batch to improve the coherence of the traversals.
+    // The rays are grouped by the octant of the direction, which determines the visiting order
+    // of the children, and then sorted along the Morton curve of the origins inside the batch.
+    std::vector<int> coherentOrder(int n, const RaySegment* rays) const {
+        Bound b;
+        for (int i = 0; i < n; i++) {
+            b = merge(b, rays[i].ray.o);
+        }
+        std::vector<std::pair<uint64_t, int>> keys(n);
+        for (int i = 0; i < n; i++) {
+            const auto& d = rays[i].ray.d;
+            const uint64_t octant = (d.x < 0 ? 1 : 0) | (d.y < 0 ? 2 : 0) | (d.z < 0 ? 4 : 0);
+            keys[i] = { (octant << 60) | (mortonCode(rays[i].ray.o, b) >> 3), i };
+        }
+        std::sort(keys.begin(), keys.end());
+        std::vector<int> order(n);
+        for (int i = 0; i < n; i++) {
+            order[i] = keys[i].second;
+        }
+        return order;
+    }
+
+public:
+    virtual void intersectBatch(int n, const RaySegment* rays, std::optional<Hit>* hits) const override {
+        // Process the rays in the coherent order and scatter the results.
+        // The implementation is called directly to avoid the virtual function call per ray.
+        for (int i : coherentOrder(n, rays)) {
+            hits[i] = Accel_SAHBVH::intersect(rays[i].ray, rays[i].tmin, rays[i].tmax);
+        }
+    }
+
+    virtual void occludedBatch(int n, const RaySegment* rays, bool* occluded) const override {
+        for (int i : coherentOrder(n, rays)) {
+            occluded[i] = Accel_SAHBVH::occluded(rays[i].ray, rays[i].tmin, rays[i].tmax);
+        }
     }
 };
 
@@ -0,0 +1,560 @@
+/*
+    Lightmetrica - Copyright (c) 2019 Hisanari Otsu
+    Distributed under MIT license. See LICENSE file for details.
+*/
+
+#include <pch.h>
+#include <lm/accel.h>
+#include <lm/scene.h>
+#include <lm/mesh.h>
+#include <lm/logger.h>
+#include <lm/exception.h>
+#include <lm/serial.h>
+#include <lm/json.h>
+#include "bvhbuilder.h"
+
+#if LM_ARCH_X64
+#include <immintrin.h>
+#define LM_WBVH_SSE 1
+#else
+#define LM_WBVH_SSE 0
+#endif
+#if LM_WBVH_SSE && defined(__AVX__)
+#define LM_WBVH_AVX 1
+#else
+#define LM_WBVH_AVX 0
+#endif
+
+LM_NAMESPACE_BEGIN(LM_NAMESPACE)
+
+using namespace bvh;
+
+namespace {
+
+// Wide BVH node storing the bounds of N children in SoA form.
+// Unused slots have an empty bound, thus never intersect with rays.
+template <int N>
+struct alignas(32) WideNode {
+    float b[2][3][N];   // Bounds of the children ([min/max][axis][child])
+    int child[N];       // Index of the child node (interior) or the first triangle (leaf)
+    int count[N];       // Number of triangles in the child. Zero for interior or unused slots
+
+    template <typename Archive>
+    void serialize(Archive& ar) {
+        for (int i = 0; i < N; i++) {
+            for (int a = 0; a < 3; a++) {
+                ar(b[0][a][i], b[1][a][i]);
+            }
+            ar(child[i], count[i]);
+        }
+    }
+};
+
+// Ray in single precision for the bound tests
+// The origins used for the near and far planes are shifted in opposite directions
+// so that the bounds are widened by the rounding error of the origin.
+struct RayF {
+    float on[3];    // Origin for the near planes
+    float of[3];    // Origin for the far planes
+    float invd[3];  // Inverse of the direction
+    int near[3];    // Index of the near side of the bound in each axis (0: min, 1: max)
+};
+
+// Checks intersection of the ray with N bounds in the node.
+// Returns the bit mask of the hit children and stores the entry distances to tn.
+// NaNs produced by the rays parallel to the slabs are ignored in the min/max operations.
+template <int N>
+int isectBounds(const WideNode<N>& n, const RayF& r, float tmin, float tmax, float* tn) {
+    int mask = 0;
+    for (int i = 0; i < N; i++) {
+        float t0 = tmin, t1 = tmax;
+        for (int a = 0; a < 3; a++) {
+            const float tn_ = (n.b[r.near[a]][a][i] - r.on[a]) * r.invd[a];
+            const float tf_ = (n.b[1-r.near[a]][a][i] - r.of[a]) * r.invd[a];
+            t0 = tn_ > t0 ? tn_ : t0;
+            t1 = tf_ < t1 ? tf_ : t1;
+        }
+        tn[i] = t0;
+        mask |= int(t0 <= t1) << i;
+    }
+    return mask;
+}
+
+#if LM_WBVH_SSE
+template <>
+int isectBounds<4>(const WideNode<4>& n, const RayF& r, float tmin, float tmax, float* tn) {
+    auto t0 = _mm_set1_ps(tmin);
+    auto t1 = _mm_set1_ps(tmax);
+    for (int a = 0; a < 3; a++) {
+        const auto on = _mm_set1_ps(r.on[a]);
+        const auto of = _mm_set1_ps(r.of[a]);
+        const auto invd = _mm_set1_ps(r.invd[a]);
+        const auto tn_ = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(n.b[r.near[a]][a]), on), invd);
+        const auto tf_ = _mm_mul_ps(_mm_sub_ps(_mm_load_ps(n.b[1-r.near[a]][a]), of), invd);
+        t0 = _mm_max_ps(tn_, t0);
+        t1 = _mm_min_ps(tf_, t1);
+    }
+    _mm_store_ps(tn, t0);
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+}
+#endif
+
+#if LM_WBVH_AVX
+template <>
+int isectBounds<8>(const WideNode<8>& n, const RayF& r, float tmin, float tmax, float* tn) {
+    auto t0 = _mm256_set1_ps(tmin);
+    auto t1 = _mm256_set1_ps(tmax);
+    for (int a = 0; a < 3; a++) {
+        const auto on = _mm256_set1_ps(r.on[a]);
+        const auto of = _mm256_set1_ps(r.of[a]);
+        const auto invd = _mm256_set1_ps(r.invd[a]);
+        const auto tn_ = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(n.b[r.near[a]][a]), on), invd);
+        const auto tf_ = _mm256_mul_ps(_mm256_sub_ps(_mm256_load_ps(n.b[1-r.near[a]][a]), of), invd);
+        t0 = _mm256_max_ps(tn_, t0);
+        t1 = _mm256_min_ps(tf_, t1);
+    }
+    _mm256_store_ps(tn, t0);
+    return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+}
+#endif
+
+}
+
+// ----------------------------------------------------------------------------
+
+/*
+\rst
+.. function:: accel::wbvh
+
+   Wide bounding volume hierarchy.
+
+   :param int width: Number of children per node. Either 4 or 8. Default value: 4.
+   :param str builder: Builder of the binary BVH (``sah`` or ``lbvh``). Default value: ``sah``.
+   :param bool binned: Use binned SAH instead of full-sort SAH. Default value: true.
+   :param int bins: Number of centroid bins per axis used when ``binned`` is true.
+                    Default value: 32.
+   :param bool spatial: Use spatial splits. Default value: false.
+   :param float split_alpha: Minimum overlap of the children relative to the root
+                             to evaluate spatial splits. Default value: 1e-5.
+   :param float max_dup_ratio: Maximum ratio of the number of triangle references to the number of triangles
+                               when ``spatial`` is true. Default value: 1.5.
+
+   Features
+
+   - Builds a binary BVH with the builder of ``accel::sahbvh`` and collapses it into 4-wide or 8-wide nodes [Dammertz2008]_.
+     The binary BVH is built in parallel, optionally with spatial splits or by LBVH, with the same parameters as ``accel::sahbvh``.
+   - The bounds of the children are stored in SoA form in single precision
+     and tested simultaneously with SSE (4-wide) or AVX (8-wide) instructions if available.
+   - Children are visited in the order of the entry distances.
+   - Uses triangle intersection by Möller and Trumbore [Möller1997]_.
+   - ``underlyingValue()`` returns the statistics of the structure in the same form as ``accel::sahbvh``.
+
+   .. [Dammertz2008] H. Dammertz, J. Hanika & A. Keller.
+                     Shallow Bounding Volume Hierarchies for Fast SIMD Ray Tracing of Incoherent Rays.
+                     Computer Graphics Forum. 27(4):1225--1233. 2008.
+\endrst
+*/
+class Accel_WBVH final : public Accel {
+private:
+    int width_;                                           // Number of children per node
+    bool linear_;                                         // True to use LBVH builder
+    bool binned_;                                         // True to use binned SAH
+    int bins_;                                            // Number of bins per axis
+    bool spatial_;                                        // True to use spatial splits
+    Float splitAlpha_;                                    // Minimum overlap relative to the root to evaluate spatial splits
+    Float maxDupRatio_;                                   // Maximum ratio of the number of references to the triangles
+    MemoryCounter scratchMem_;                            // Scratch memory used by the builder
+    std::vector<WideNode<4>> nodes4_;                     // Nodes for 4-wide BVH
+    std::vector<WideNode<8>> nodes8_;                     // Nodes for 8-wide BVH
+    std::vector<Tri> trs_;                                // Triangles in the order of leaves
+    std::vector<FlattenedPrimitiveNode> flattenedNodes_;  // Flattened scene graph
+
+public:
+    LM_SERIALIZE_IMPL(ar) {
+        ar(width_, linear_, binned_, bins_, spatial_, splitAlpha_, maxDupRatio_, nodes4_, nodes8_, trs_, flattenedNodes_);
+    }
+
+public:
+    virtual bool construct(const Json& prop) override {
+        width_ = json::value(prop, "width", 4);
+        if (width_ != 4 && width_ != 8) {
+            LM_ERROR("Invalid width [width='{}']", width_);
+            return false;
+        }
+        const auto builder = json::value<std::string>(prop, "builder", "sah");
+        if (builder != "sah" && builder != "lbvh") {
+            LM_ERROR("Invalid builder [builder='{}']", builder);
+            return false;
+        }
+        linear_ = builder == "lbvh";
+        binned_ = json::value(prop, "binned", true);
+        bins_ = json::value(prop, "bins", 32);
+        if (bins_ < 2) {
+            LM_ERROR("Invalid number of bins [bins='{}']", bins_);
+            return false;
+        }
+        spatial_ = json::value(prop, "spatial", false);
+        splitAlpha_ = json::value(prop, "split_alpha", 1e-5_f);
+        maxDupRatio_ = json::value(prop, "max_dup_ratio", 1.5_f);
+        if (maxDupRatio_ < 1_f) {
+            LM_ERROR("Invalid maximum duplication ratio [max_dup_ratio='{}']", maxDupRatio_);
+            return false;
+        }
+        if (linear_ && spatial_) {
+            LM_ERROR("Spatial splits are not supported with LBVH builder");
+            return false;
+        }
+        return true;
+    }
+
+    virtual Json underlyingValue(const std::string& query) const override {
+        LM_UNUSED(query);
+        return width_ == 4 ? stats<4>() : stats<8>();
+    }
+
+private:
+    // Computes the statistics of the structure.
+    // The leaves are the slots referencing the triangles and the depth of a leaf is the depth of its wide node.
+    template <int N>
+    Json stats() const {
+        const auto& ns = nodes<N>();
+        long long leaves = 0;
+        long long leafDepths = 0;
+        int maxDepth = 0;
+        std::vector<long long> leafSizes;
+        std::vector<std::pair<int, int>> stack;  // (node index, depth)
+        if (!ns.empty()) {
+            stack.push_back({ 0, 0 });
+        }
+        while (!stack.empty()) {
+            const auto [ni, depth] = stack.back();
+            stack.pop_back();
+            const auto& n = ns[ni];
+            for (int k = 0; k < N; k++) {
+                if (n.child[k] < 0) {
+                    continue;
+                }
+                if (const int c = n.count[k]; c > 0) {
+                    leaves++;
+                    leafDepths += depth;
+                    maxDepth = std::max(maxDepth, depth);
+                    if (int(leafSizes.size()) <= c) {
+                        leafSizes.resize(c + 1);
+                    }
+                    leafSizes[c]++;
+                }
+                else {
+                    stack.push_back({ n.child[k], depth + 1 });
+                }
+            }
+        }
+        return {
+            { "nodes", ns.size() },
+            { "leaves", leaves },
+            { "max_depth", maxDepth },
+            { "avg_depth", leaves > 0 ? Float(leafDepths) / leaves : 0_f },
+            { "leaf_size_histogram", leafSizes },
+            { "triangles", trs_.size() },
+            { "memory", ns.capacity() * sizeof(WideNode<N>) +
+                trs_.capacity() * sizeof(Tri) +
+                flattenedNodes_.capacity() * sizeof(FlattenedPrimitiveNode) }
+        };
+    }
+
+    template <int N>
+    std::vector<WideNode<N>>& nodes() {
+        if constexpr (N == 4) { return nodes4_; } else { return nodes8_; }
+    }
+
+    template <int N>
+    const std::vector<WideNode<N>>& nodes() const {
+        if constexpr (N == 4) { return nodes4_; } else { return nodes8_; }
+    }
+
+    // Collapses the subtree of the binary BVH into wide nodes.
+    // The first child of an interior binary node is the next node and the second child is given by the offset.
+    // The children are collected by repeatedly opening the interior child with the largest surface area.
+    // Returns index of the created wide node.
+    template <int N>
+    int collapse(const BVH& bvh, int bi, Float pad) {
+        const auto& bnodes = bvh.nodes;
+        const auto bound = [&](int i) {
+            return Bound{ Vec3(bnodes[i].mi), Vec3(bnodes[i].ma) };
+        };
+        std::vector<int> cs;
+        if (bnodes[bi].count() > 0) {
+            cs.push_back(bi);
+        }
+        else {
+            cs.push_back(bi + 1);
+            cs.push_back(bnodes[bi].offset);
+        }
+        while (int(cs.size()) < N) {
+            int j = -1;
+            Float maxSA = -1_f;
+            for (int k = 0; k < int(cs.size()); k++) {
+                if (bnodes[cs[k]].count() == 0 && bound(cs[k]).surfaceArea() > maxSA) {
+                    maxSA = bound(cs[k]).surfaceArea();
+                    j = k;
+                }
+            }
+            if (j < 0) {
+                break;
+            }
+            const int c = cs[j];
+            cs[j] = c + 1;
+            cs.push_back(bnodes[c].offset);
+        }
+
+        // Create the wide node and fill the slots
+        auto& ns = nodes<N>();
+        const int wi = int(ns.size());
+        ns.emplace_back();
+        for (int k = 0; k < N; k++) {
+            auto& n = ns[wi];
+            if (k >= int(cs.size())) {
+                for (int a = 0; a < 3; a++) {
+                    n.b[0][a][k] = std::numeric_limits<float>::infinity();
+                    n.b[1][a][k] = -std::numeric_limits<float>::infinity();
+                }
+                n.child[k] = -1;
+                n.count[k] = 0;
+                continue;
+            }
+            // Pad the bound to absorb rounding errors of the ray in single precision
+            const auto& c = bnodes[cs[k]];
+            for (int a = 0; a < 3; a++) {
+                n.b[0][a][k] = std::nextafter(float(Float(c.mi[a]) - pad), -std::numeric_limits<float>::infinity());
+                n.b[1][a][k] = std::nextafter(float(Float(c.ma[a]) + pad), std::numeric_limits<float>::infinity());
+            }
+            if (c.count() > 0) {
+                n.child[k] = c.offset;
+                n.count[k] = c.count();
+            }
+            else {
+                // Note that the recursion might reallocate the storage
+                const int ci = collapse<N>(bvh, cs[k], pad);
+                ns[wi].child[k] = ci;
+                ns[wi].count[k] = 0;
+            }
+        }
+        return wi;
+    }
+
+    // Traverses the nodes intersecting with the ray visiting the nearest child first.
+    // processLeaf(offset, count) is called for each leaf node and might shrink tmax.
+    // The traversal terminates when the function returns true.
+    template <int N, typename ProcessLeaf>
+    void traverse(Ray ray, Float tmin, const Float& tmax, const ProcessLeaf& processLeaf) const {
+        const auto& ns = nodes<N>();
+        if (ns.empty()) {
+            return;
+        }
+
+        // Ray in single precision.
+        // The padding of the bounds in the build only covers the errors relative to the scene,
+        // so the bounds are further widened by |o|*2^-23 per axis for the rounding of the origin,
+        // which is twice the conversion error to cover the rounding of the shifted origins.
+        RayF rf;
+        for (int a = 0; a < 3; a++) {
+            rf.invd[a] = 1.f / float(ray.d[a]);
+            rf.near[a] = rf.invd[a] < 0 ? 1 : 0;
+            const Float d = glm::abs(ray.o[a]) * Float(1.0 / (1 << 23));
+            const Float sd = rf.invd[a] < 0 ? -d : d;
+            rf.on[a] = float(ray.o[a] + sd);
+            rf.of[a] = float(ray.o[a] - sd);
+        }
+        const float tminF = std::nextafter(float(tmin), -std::numeric_limits<float>::infinity());
+
+        // Traversal stack. Each visit of a wide node pops one entry and pushes at most N entries,
+        // so the size is bounded by the depth of the tree.
+        struct Entry {
+            int child;  // Index of the child node or the first triangle
+            int count;  // Number of triangles. Zero for interior nodes
+            float t;    // Entry distance to the bound
+        };
+        Entry s[MaxDepth * (N - 1) + 1];
+        int si = 0;
+        s[si++] = { 0, 0, tminF };
+
+        while (si > 0) {
+            const auto e = s[--si];
+            if (e.t > tmax) {
+                // Farther than the current closest hit
+                continue;
+            }
+            if (e.count > 0) {
+                if (processLeaf(e.child, e.count)) {
+                    break;
+                }
+                continue;
+            }
+
+            // Intersect with the bounds of the children
+            const auto& n = ns[e.child];
+            alignas(32) float tn[N];
+            const float tmaxF = std::nextafter(float(tmax), std::numeric_limits<float>::infinity());
+            int mask = isectBounds<N>(n, rf, tminF, tmaxF, tn);
+
+            // Push the hit children so that the nearest child is visited first
+            Entry cs[N];
+            int nc = 0;
+            for (int k = 0; mask; k++, mask >>= 1) {
+                if (!(mask & 1)) {
+                    continue;
+                }
+                Entry c{ n.child[k], n.count[k], tn[k] };
+                int j = nc++;
+                for (; j > 0 && cs[j-1].t < c.t; j--) {
+                    cs[j] = cs[j-1];
+                }
+                cs[j] = c;
+            }
+            for (int j = 0; j < nc; j++) {
+                s[si++] = cs[j];
+            }
+        }
+    }
+
+    template <int N>
+    std::optional<Hit> intersectWide(Ray ray, Float tmin, Float tmax) const {
+        std::optional<Tri::Hit> mh, h;
+        int mi = -1;
+        traverse<N>(ray, tmin, tmax, [&](int offset, int count) {
+            for (int i = offset; i < offset + count; i++) {
+                if (h = trs_[i].isect(ray, tmin, tmax)) {
+                    mh = h;
+                    tmax = h->t;
+                    mi = i;
+                }
+            }
+            return false;
+        });
+        if (!mh) {
+            return {};
+        }
+        const auto& tr = trs_.at(mi);
+        const auto& fn = flattenedNodes_.at(tr.flattenedNode);
+        return Hit{ tmax, Vec2(mh->u, mh->v), &fn.globalTransform, fn.primitive, tr.face };
+    }
+
+    template <int N>
+    bool occludedWide(Ray ray, Float tmin, Float tmax) const {
+        bool hit = false;
+        traverse<N>(ray, tmin, tmax, [&](int offset, int count) {
+            for (int i = offset; i < offset + count; i++) {
+                if (trs_[i].isect(ray, tmin, tmax)) {
+                    hit = true;
+                    return true;
+                }
+            }
+            return false;
+        });
+        return hit;
+    }
+
+public:
+    virtual void build(const Scene& scene) override {
+        // Flatten the scene graph and setup triangle list
+        LM_INFO("Flattening scene");
+        std::vector<Tri> trs;
+        std::vector<Bound> tb;
+        flattenedNodes_.clear();
+        for (int i = 0; i < scene.numPrimitiveInstances(); i++) {
+            const auto& inst = scene.primitiveInstanceAt(i);
+            const auto* mesh = scene.nodeAt(inst.node).primitive.mesh;
+            if (!mesh) {
+                continue;
+            }
+
+            // Record flattened primitive
+            const int flattenNodeIndex = int(flattenedNodes_.size());
+            flattenedNodes_.push_back({ inst.globalTransform, inst.node });
+
+            // Record triangles
+            const auto& M = inst.globalTransform.M;
+            mesh->foreachTriangle([&](int face, const Mesh::Tri& tri) {
+                const Vec3 p1 = M * Vec4(tri.p1.p, 1_f);
+                const Vec3 p2 = M * Vec4(tri.p2.p, 1_f);
+                const Vec3 p3 = M * Vec4(tri.p3.p, 1_f);
+                trs.emplace_back(p1, p2, p3, flattenNodeIndex, face);
+                Bound b;
+                b = merge(b, p1);
+                b = merge(b, p2);
+                b = merge(b, p3);
+                tb.push_back(b);
+            });
+        }
+
+        // --------------------------------------------------------------------
+
+        const int nt = int(trs.size());
+        nodes4_.clear();
+        nodes8_.clear();
+        trs_.clear();
+        if (nt == 0) {
+            LM_INFO("Empty scene");
+            return;
+        }
+
+        // Build binary BVH with the same builder as accel::sahbvh.
+        // The triangles are intersected one by one in the leaves, thus the block size is 1.
+        LM_INFO("Building");
+        scratchMem_.curr = 0;
+        scratchMem_.peak = 0;
+        BVH bvh;
+        BVHBuilder builder(bvh, tb, binned_, bins_, 1, scratchMem_);
+        if (spatial_) {
+            builder.buildSpatial(bvh, [&](int i, int axis, Float pos) {
+                return trs[i].split(axis, pos);
+            }, splitAlpha_, maxDupRatio_);
+        }
+        else if (linear_) {
+            builder.buildLinear(bvh);
+        }
+        else {
+            builder.build(bvh);
+        }
+
+        // Reorder the triangles so that the triangles in a leaf are contiguous.
+        // The triangles referenced from multiple leaves by spatial splits are duplicated.
+        trs_.reserve(bvh.indices.size());
+        for (int i : bvh.indices) {
+            trs_.push_back(trs[i]);
+        }
+
+        // Collapse into wide BVH.
+        // The padding is proportional to the magnitude of the scene
+        // so that it covers the rounding errors of the bounds and the slab tests.
+        // The rounding error of the ray origin is covered per query in traverse().
+        LM_INFO("Collapsing");
+        const auto rb = bvh.bound();
+        const Float pad = glm::max(glm::compMax(glm::abs(rb.mi)), glm::compMax(glm::abs(rb.ma))) * 1e-6_f;
+        if (width_ == 4) {
+            collapse<4>(bvh, 0, pad);
+        }
+        else {
+            collapse<8>(bvh, 0, pad);
+        }
+        LM_INFO("Nodes [binary='{}', wide='{}', scratch='{}']", bvh.nodes.size(),
+            width_ == 4 ? nodes4_.size() : nodes8_.size(), formatMB(scratchMem_.peak));
+    }
+
+    virtual std::optional<Hit> intersect(Ray ray, Float tmin, Float tmax) const override {
+        exception::ScopedDisableFPEx guard_;  // Disable floating point exceptions
+        return width_ == 4
+            ? intersectWide<4>(ray, tmin, tmax)
+            : intersectWide<8>(ray, tmin, tmax);
+    }
+
+    virtual bool occluded(Ray ray, Float tmin, Float tmax) const override {
+        exception::ScopedDisableFPEx guard_;
+        return width_ == 4
+            ? occludedWide<4>(ray, tmin, tmax)
+            : occludedWide<8>(ray, tmin, tmax);
+    }
+};
+
+LM_COMP_REG_IMPL(Accel_WBVH, "accel::wbvh");
+
+LM_NAMESPACE_END(LM_NAMESPACE)
@@ -0,0 +1,1092 @@
+/*
+    Lightmetrica - Copyright (c) 2019 Hisanari Otsu
+    Distributed under MIT license. See LICENSE file for details.
+*/
+
+#pragma once
+
+#include <lm/math.h>
+#include <lm/parallel.h>
+
+#if LM_COMPILER_MSVC
+#include <intrin.h>
+#endif
+
+// Binary BVH builder shared by the BVH-based acceleration structures (accel::sahbvh, accel::wbvh).
+// The builder produces the nodes linearized in depth-first order,
+// which are traversed as they are or collapsed into other forms by the acceleration structures.
+
+LM_NAMESPACE_BEGIN(LM_NAMESPACE)
+LM_NAMESPACE_BEGIN(bvh)
+
+struct FlattenedPrimitiveNode {
+    Transform globalTransform;  // Global transform of the primitive
+    int primitive;              // Primitive node index
+
+    template <typename Archive>
+    void serialize(Archive& ar) {
+        ar(globalTransform, primitive);
+    }
+};
+
+struct Tri {
+    Vec3 p1;            // One vertex of the triangle
+    Vec3 e1, e2;        // Two edges incident to p1
+    int flattenedNode;  // Index of flattened primitive associated to the triangle
+    int face;           // Face index of the mesh associated to the triangle
+
+    template <typename Archive>
+    void serialize(Archive& ar) {
+        ar(p1, e1, e2, flattenedNode, face);
+    }
+
+    Tri() {}
+
+    Tri(Vec3 p1, Vec3 p2, Vec3 p3, int flattenedNode, int face)
+        : p1(p1), e1(p2 - p1), e2(p3 - p1), flattenedNode(flattenedNode), face(face) {}
+
+    // Hit information
+    struct Hit {
+        Float t;     // Distance to the triangle
+        Float u, v;  // Hitpoint in barycentric coordinates
+    };
+
+    // Checks intersection with a ray [Möller & Trumbore 1997]
+    std::optional<Hit> isect(Ray r, Float tl, Float th) const {
+        auto p = glm::cross(r.d, e2);
+        auto tv = r.o - p1;
+        auto q = glm::cross(tv, e1);
+        auto d = glm::dot(e1, p);
+        auto ad = glm::abs(d);
+        auto s = std::copysign(1_f, d);
+        auto u = glm::dot(tv, p) * s;
+        auto v = glm::dot(r.d, q) * s;
+        if (ad < 1e-8_f || u < 0_f || v < 0_f || u + v > ad) {
+            return {};
+        }
+        auto t = glm::dot(e2, q) / d;
+        if (t < tl || th < t) {
+            return {};
+        }
+        return Hit{ t, u / ad, v / ad };
+    }
+
+    // Splits the triangle by the axis-aligned plane at pos.
+    // Returns the bounds of the parts in the left and right sides of the plane.
+    std::pair<Bound, Bound> split(int axis, Float pos) const {
+        const Vec3 ps[3] = { p1, p1 + e1, p1 + e2 };
+        Bound l, r;
+        for (int i = 0; i < 3; i++) {
+            const auto& v1 = ps[i];
+            const auto& v2 = ps[(i + 1) % 3];
+            if (v1[axis] <= pos) {
+                l = merge(l, v1);
+            }
+            if (v1[axis] >= pos) {
+                r = merge(r, v1);
+            }
+            // Add the intersection point of the edge and the plane to both sides
+            if ((v1[axis] < pos && pos < v2[axis]) || (v2[axis] < pos && pos < v1[axis])) {
+                auto p = glm::mix(v1, v2, (pos - v1[axis]) / (v2[axis] - v1[axis]));
+                p[axis] = pos;
+                l = merge(l, p);
+                r = merge(r, p);
+            }
+        }
+        return { l, r };
+    }
+};
+
+// BVH node used during the build
+struct Node {
+    Bound b;        // Bound of the node
+    bool leaf = 0;  // True if the node is leaf
+    int s, e;       // Range of primitive indices (valid only in leaf nodes)
+    int c1, c2;     // Index to the child nodes
+    int axis;       // Split axis (valid only in interior nodes)
+};
+
+// Checks intersection of the bound and the ray with precomputed inverse of the direction
+inline bool isectBound(const Bound& b, Vec3 o, Vec3 invd, Float tmin, Float tmax) {
+    for (int i = 0; i < 3; i++) {
+        auto t1 = (b.mi[i] - o[i]) * invd[i];
+        auto t2 = (b.ma[i] - o[i]) * invd[i];
+        if (invd[i] < 0) {
+            std::swap(t1, t2);
+        }
+        tmin = glm::max(t1, tmin);
+        tmax = glm::min(t2, tmax);
+        if (tmax < tmin) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Compact BVH node linearized in depth-first order.
+// The first child of an interior node is the next node in the array.
+struct LinearNode {
+    glm::vec3 mi;   // Minimum coordinates of the bound rounded outward
+    int offset;     // Index of the first primitive (leaf) or the second child (interior)
+    glm::vec3 ma;   // Maximum coordinates of the bound rounded outward
+    int meta;       // (number of primitives << 2) | split axis. Number of primitives is zero for interior nodes
+
+    template <typename Archive>
+    void serialize(Archive& ar) {
+        ar(mi, offset, ma, meta);
+    }
+
+    int count() const { return meta >> 2; }
+    int axis() const { return meta & 3; }
+
+    // Checks intersection to the ray with precomputed inverse of the direction
+    bool isect(Vec3 o, Vec3 invd, Float tmin, Float tmax) const {
+        return isectBound(Bound{ Vec3(mi), Vec3(ma) }, o, invd, tmin, tmax);
+    }
+};
+static_assert(sizeof(LinearNode) == 32, "Unexpected size of LinearNode");
+
+// Maximum depth of the tree, which bounds the size of the traversal stack
+constexpr int MaxDepth = 64;
+
+// Split of the primitives in a node
+struct Split {
+    int axis;   // Split axis
+    int m;      // Split position in the primitive indices
+};
+
+// Reference to a primitive whose bound might be clipped by spatial splits
+struct Ref {
+    Bound b;    // Bound of the referenced part of the primitive
+    int i;      // Primitive index
+};
+
+// Splits the primitive i by the axis-aligned plane at pos.
+// Returns the bounds of the parts of the primitive in the left and right sides of the plane.
+using SplitPrimitiveFunc = std::function<std::pair<Bound, Bound>(int i, int axis, Float pos)>;
+
+// Computes intersection of two bounds. Returns an empty bound if the bounds do not overlap.
+inline Bound intersectBound(const Bound& a, const Bound& b) {
+    const Bound r{ glm::max(a.mi, b.mi), glm::min(a.ma, b.ma) };
+    if (r.ma.x < r.mi.x || r.ma.y < r.mi.y || r.ma.z < r.mi.z) {
+        return {};
+    }
+    return r;
+}
+
+// Converts a vector to single precision rounding toward the given direction
+inline glm::vec3 roundToFloat(Vec3 v, float dir) {
+    glm::vec3 r(v);
+    for (int i = 0; i < 3; i++) {
+        if (dir < 0 ? Float(r[i]) > v[i] : Float(r[i]) < v[i]) {
+            r[i] = std::nextafter(r[i], dir * std::numeric_limits<float>::infinity());
+        }
+    }
+    return r;
+}
+
+// Tracks current and peak size of transient memory in bytes
+struct MemoryCounter {
+    std::atomic<size_t> curr = 0;
+    std::atomic<size_t> peak = 0;
+
+    void add(size_t bytes) {
+        const size_t v = curr += bytes;
+        size_t p = peak;
+        while (v > p && !peak.compare_exchange_weak(p, v));
+    }
+
+    void sub(size_t bytes) {
+        curr -= bytes;
+    }
+};
+
+// Scratch buffer used during the build whose size is reported to the memory counter
+template <typename T>
+class ScratchBuffer {
+private:
+    std::vector<T> v_;
+    MemoryCounter& mc_;
+
+public:
+    ScratchBuffer(MemoryCounter& mc, size_t n) : v_(n), mc_(mc) {
+        mc_.add(n * sizeof(T));
+    }
+
+    ~ScratchBuffer() {
+        mc_.sub(v_.size() * sizeof(T));
+    }
+
+    T& operator[](size_t i) { return v_[i]; }
+    auto begin() { return v_.begin(); }
+    auto end() { return v_.end(); }
+};
+
+// Formats bytes in megabytes
+inline std::string formatMB(size_t bytes) {
+    return fmt::format("{:.2f}MB", double(bytes) / (1 << 20));
+}
+
+// BVH over primitives specified by their bounds.
+// Leaf nodes reference ranges of the primitive indices.
+struct BVH {
+    std::vector<LinearNode> nodes;  // Nodes in depth-first order
+    std::vector<int> indices;       // Primitive indices
+
+    template <typename Archive>
+    void serialize(Archive& ar) {
+        ar(nodes, indices);
+    }
+
+    // Bound of the root node
+    Bound bound() const {
+        return nodes.empty() ? Bound() : Bound{ Vec3(nodes[0].mi), Vec3(nodes[0].ma) };
+    }
+
+    // Number of primitive references in the leaves
+    size_t numReferences() const {
+        size_t n = 0;
+        for (const auto& node : nodes) {
+            n += node.count();
+        }
+        return n;
+    }
+
+    // Estimated traversal cost of the tree according to SAH.
+    // The costs of a traversal step and an intersection with a block of primitives are both assumed to be 1.
+    Float sahCost(int blockSize) const {
+        if (nodes.empty()) {
+            return 0_f;
+        }
+        Float c = 0_f;
+        for (const auto& n : nodes) {
+            c += Bound{ Vec3(n.mi), Vec3(n.ma) }.surfaceArea() * (n.count() > 0 ? (n.count() + blockSize - 1) / blockSize : 1);
+        }
+        return c / bound().surfaceArea();
+    }
+
+    // Traverses the nodes intersecting with the ray visiting the child near to the ray origin first.
+    // processLeaf(offset, count) is called for each leaf node and might shrink tmax.
+    // The primitives in the leaf are given by indices[offset, offset+count).
+    // The traversal terminates when the function returns true.
+    // Returns the number of visited nodes.
+    template <typename ProcessLeaf>
+    int traverse(Ray ray, Float tmin, const Float& tmax, const ProcessLeaf& processLeaf) const {
+        if (nodes.empty()) {
+            return 0;
+        }
+        const auto invd = 1_f / ray.d;
+        int s[MaxDepth];
+        int si = 0;
+        int ni = 0;
+        int visited = 0;
+        while (true) {
+            const auto& n = nodes[ni];
+            visited++;
+            if (!n.isect(ray.o, invd, tmin, tmax)) {
+                if (si == 0) {
+                    break;
+                }
+                ni = s[--si];
+                continue;
+            }
+            if (const int c = n.count(); c == 0) {
+                // Visit the child near to the ray origin first
+                if (invd[n.axis()] < 0) {
+                    s[si++] = ni + 1;
+                    ni = n.offset;
+                }
+                else {
+                    s[si++] = n.offset;
+                    ni = ni + 1;
+                }
+            }
+            else {
+                if (processLeaf(n.offset, c)) {
+                    break;
+                }
+                if (si == 0) {
+                    break;
+                }
+                ni = s[--si];
+            }
+        }
+        return visited;
+    }
+};
+
+// Counts the number of leading zero bits
+inline int countLeadingZeros(uint64_t x) {
+#if LM_COMPILER_MSVC
+    unsigned long i;
+    return _BitScanReverse64(&i, x) ? 63 - int(i) : 64;
+#else
+    return x ? __builtin_clzll(x) : 64;
+#endif
+}
+
+// Number of bits per axis of Morton codes
+constexpr int MortonBits = 21;
+
+// Inserts two zero bits between each of the lower 21 bits
+inline uint64_t expandBits(uint64_t x) {
+    x &= 0x1fffff;
+    x = (x | x << 32) & 0x1f00000000ffffull;
+    x = (x | x << 16) & 0x1f0000ff0000ffull;
+    x = (x | x << 8) & 0x100f00f00f00f00full;
+    x = (x | x << 4) & 0x10c30c30c30c30c3ull;
+    x = (x | x << 2) & 0x1249249249249249ull;
+    return x;
+}
+
+// Computes 63-bit Morton code of the point in the bound.
+// The bits of x, y, and z axes are interleaved in this order from the least significant bit.
+inline uint64_t mortonCode(Vec3 p, const Bound& b) {
+    uint64_t code = 0;
+    for (int a = 0; a < 3; a++) {
+        const auto w = b.ma[a] - b.mi[a];
+        const auto v = w > 0_f ? (p[a] - b.mi[a]) / w : 0_f;
+        const auto q = uint64_t(glm::clamp(v * (1 << MortonBits), 0_f, Float((1 << MortonBits) - 1)));
+        code |= expandBits(q) << a;
+    }
+    return code;
+}
+
+// Processes [0,n) split into contiguous chunks by the tasks of the parallel context.
+// func(chunk, start, end) is called for each chunk.
+template <typename Func>
+void parallelChunks(int n, int numChunks, const Func& func) {
+    parallel::tasks([&](const parallel::SpawnTaskFunc& spawn) {
+        for (int t = 0; t < numChunks; t++) {
+            spawn([&, t]() {
+                func(t, int(int64_t(n) * t / numChunks), int(int64_t(n) * (t + 1) / numChunks));
+            });
+        }
+    });
+}
+
+// Builds BVH with surface area heuristics
+class BVHBuilder {
+private:
+    const std::vector<Bound>& bs_;  // Bounds of the primitives
+    std::vector<Vec3> cs_;          // Centers of the bounds
+    std::vector<int>& indices_;     // Primitive indices being partitioned
+    bool binned_;                   // True to use binned SAH
+    int bins_;                      // Number of bins per axis
+    int blockSize_;                 // Number of primitives intersected at once in the leaves
+    MemoryCounter& scratchMem_;     // Scratch memory used by the builder
+
+    // Minimum number of primitives to process the subtrees or the chunks in separate tasks
+    static constexpr int MinTaskSize = 1024;
+
+public:
+    BVHBuilder(BVH& bvh, const std::vector<Bound>& bs, bool binned, int bins, int blockSize, MemoryCounter& scratchMem)
+        : bs_(bs)
+        , indices_(bvh.indices)
+        , binned_(binned)
+        , bins_(bins)
+        , blockSize_(blockSize)
+        , scratchMem_(scratchMem)
+    {
+        cs_.reserve(bs.size());
+        for (const auto& b : bs) {
+            cs_.push_back(b.center());
+        }
+        scratchMem_.add(cs_.capacity() * sizeof(Vec3));
+    }
+
+    ~BVHBuilder() {
+        scratchMem_.sub(cs_.capacity() * sizeof(Vec3));
+    }
+
+private:
+    // Intersection cost of the leaf with n primitives.
+    // The primitives are intersected per block, thus the cost is the number of blocks.
+    Float leafCost(int n) const {
+        return Float((n + blockSize_ - 1) / blockSize_);
+    }
+
+    // Finds a split of the primitives in [s,e) by sorting the primitives along each axis.
+    // Returns the split or nullopt if making a leaf is cheaper.
+    std::optional<Split> splitByFullSort(int s, int e, const Bound& nb) {
+        // Function to sort the primitives according to the given axis
+        auto st = [&](int ax) {
+            auto cmp = [&](int i1, int i2) {
+                return cs_[i1][ax] < cs_[i2][ax];
+            };
+            std::sort(&indices_[s], &indices_[e-1]+1, cmp);
+        };
+
+        // Selects a split axis and position according to SAH.
+        // The scratch memory is proportional to the number of primitives in the node.
+        const int n = e - s;
+        ScratchBuffer<Float> r(scratchMem_, n);  // r[i]: Cost of right partition [s+i,e)
+        Float b = Inf;
+        int bi = -1, ba = -1;
+        for (int a = 0; a < 3; a++) {
+            st(a);
+            Bound br;
+            for (int i = n - 1; i > 0; i--) {
+                br = merge(br, bs_[indices_[s+i]]);
+                r[i] = br.surfaceArea() * leafCost(n - i);
+            }
+            Bound bl;
+            for (int i = 1; i < n; i++) {
+                bl = merge(bl, bs_[indices_[s+i-1]]);
+                const auto c = 1_f + (bl.surfaceArea()*leafCost(i) + r[i])/nb.surfaceArea();
+                if (c < b) {
+                    b = c;
+                    bi = i;
+                    ba = a;
+                }
+            }
+        }
+        if (b > leafCost(e - s)) {
+            return {};
+        }
+        st(ba);
+        return Split{ ba, s + bi };
+    }
+
+    // Finds a split of the primitives in [s,e) by binning the centroids along each axis.
+    // The primitives are partitioned in place according to the selected split.
+    // Returns the split or nullopt if making a leaf is cheaper.
+    std::optional<Split> splitByBinning(int s, int e, const Bound& nb) {
+        // Bound of the centroids
+        Bound cb;
+        for (int i = s; i < e; i++) {
+            cb = merge(cb, cs_[indices_[i]]);
+        }
+
+        // Function to compute bin index of the primitive according to the given axis
+        const auto binIndex = [&](int i, int ax) {
+            const auto w = cb.ma[ax] - cb.mi[ax];
+            const int bi = int(bins_ * (cs_[i][ax] - cb.mi[ax]) / w);
+            return glm::clamp(bi, 0, bins_ - 1);
+        };
+
+        // Selects a split axis and bin according to SAH.
+        // The scratch memory is constant regardless of the number of primitives.
+        struct Bin {
+            Bound b;    // Bound of the primitives in the bin
+            int n;      // Number of primitives in the bin
+        };
+        ScratchBuffer<Bin> bs(scratchMem_, bins_);
+        ScratchBuffer<Float> r(scratchMem_, bins_);
+        Float b = Inf;
+        int bb = -1, ba = -1;
+        for (int a = 0; a < 3; a++) {
+            // Skip the axis if the centroids are degenerated
+            if (cb.ma[a] - cb.mi[a] <= 0_f) {
+                continue;
+            }
+
+            // Accumulate the primitives into the bins
+            std::fill(bs.begin(), bs.end(), Bin{ Bound(), 0 });
+            for (int i = s; i < e; i++) {
+                auto& bin = bs[binIndex(indices_[i], a)];
+                bin.b = merge(bin.b, bs_[indices_[i]]);
+                bin.n++;
+            }
+
+            // Sweep from the right to compute the costs of the right partitions
+            Bound br;
+            int nr = 0;
+            for (int j = bins_ - 1; j > 0; j--) {
+                br = merge(br, bs[j].b);
+                nr += bs[j].n;
+                r[j] = nr == 0 ? 0_f : br.surfaceArea() * leafCost(nr);
+            }
+
+            // Sweep from the left and evaluate the SAH cost of each split
+            Bound bl;
+            int nl = 0;
+            for (int j = 1; j < bins_; j++) {
+                bl = merge(bl, bs[j-1].b);
+                nl += bs[j-1].n;
+                if (nl == 0 || nl == e - s) {
+                    continue;
+                }
+                const auto c = 1_f + (bl.surfaceArea()*leafCost(nl) + r[j])/nb.surfaceArea();
+                if (c < b) {
+                    b = c;
+                    bb = j;
+                    ba = a;
+                }
+            }
+        }
+        if (ba < 0 || b > leafCost(e - s)) {
+            return {};
+        }
+
+        // Partition the primitives in place
+        const auto* m = std::partition(&indices_[s], &indices_[e-1]+1, [&](int i) {
+            return binIndex(i, ba) < bb;
+        });
+        return Split{ ba, int(m - indices_.data()) };
+    }
+
+    // Linearizes the nodes in depth-first order
+    void linearize(BVH& bvh, const std::vector<Node>& nodes, int nn) const {
+        bvh.nodes.clear();
+        bvh.nodes.reserve(nn);
+        std::vector<std::tuple<int, int>> stack;  // (node index, index of parent linear node if second child)
+        stack.push_back({ 0, -1 });
+        while (!stack.empty()) {
+            const auto [ni, parent] = stack.back();
+            stack.pop_back();
+            const int li = int(bvh.nodes.size());
+            if (parent >= 0) {
+                bvh.nodes[parent].offset = li;
+            }
+            const auto& n = nodes[ni];
+            bvh.nodes.push_back({
+                roundToFloat(n.b.mi, -1.f),
+                n.leaf ? n.s : -1,
+                roundToFloat(n.b.ma, 1.f),
+                n.leaf ? ((n.e - n.s) << 2) : n.axis
+            });
+            if (!n.leaf) {
+                // Push the second child first so that the first child is placed next
+                stack.push_back({ n.c2, li });
+                stack.push_back({ n.c1, -1 });
+            }
+        }
+    }
+
+    // Bin used to find the split of the references
+    struct RefBin {
+        Bound b;    // Bound of the references in the bin
+        int enter;  // Number of references starting in the bin
+        int exit;   // Number of references ending in the bin
+    };
+
+    // Candidate split of the references
+    struct RefSplit {
+        Float cost = Inf;   // SAH cost
+        int axis = -1;      // Split axis
+        int bin;            // Split position in the bins
+        Bound bl, br;       // Bounds of the left and right partitions
+    };
+
+    // Sweeps the bins along the axis and updates the split if the SAH cost is smaller
+    void sweepBins(ScratchBuffer<RefBin>& bins, int axis, const Bound& nb, RefSplit& split) {
+        ScratchBuffer<Bound> rb(scratchMem_, bins_);
+        ScratchBuffer<int> rn(scratchMem_, bins_);
+        Bound br;
+        int nr = 0;
+        for (int j = bins_ - 1; j > 0; j--) {
+            br = merge(br, bins[j].b);
+            nr += bins[j].exit;
+            rb[j] = br;
+            rn[j] = nr;
+        }
+        Bound bl;
+        int nl = 0;
+        for (int j = 1; j < bins_; j++) {
+            bl = merge(bl, bins[j-1].b);
+            nl += bins[j-1].enter;
+            if (nl == 0 || rn[j] == 0) {
+                continue;
+            }
+            const auto c = 1_f + (bl.surfaceArea()*leafCost(nl) + rb[j].surfaceArea()*leafCost(rn[j]))/nb.surfaceArea();
+            if (c < split.cost) {
+                split = { c, axis, j, bl, rb[j] };
+            }
+        }
+    }
+
+    // Clips the reference by the axis-aligned plane at pos.
+    // Returns the references in the left and right sides, which might be empty.
+    std::pair<Ref, Ref> clipRef(const SplitPrimitiveFunc& splitPrimitive, const Ref& ref, int axis, Float pos) const {
+        const auto [l, r] = splitPrimitive(ref.i, axis, pos);
+        return { Ref{ intersectBound(l, ref.b), ref.i }, Ref{ intersectBound(r, ref.b), ref.i } };
+    }
+
+    // Partitions the references in a node into two children either by object split or spatial split.
+    // A spatial split is only evaluated when the overlap of the children of the best object split is large.
+    // The number of references is bounded by maxRefs.
+    // Returns the split axis or -1 if making a leaf is cheaper.
+    int splitReferences(std::vector<Ref>& refs, const Bound& nb, std::vector<Ref>& left, std::vector<Ref>& right,
+        const SplitPrimitiveFunc& splitPrimitive, Float minOverlap, std::atomic<int>& numRefs, int maxRefs)
+    {
+        const int n = int(refs.size());
+        ScratchBuffer<RefBin> bins(scratchMem_, bins_);
+
+        // Find the best object split by binning the centroids of the references
+        Bound cb;
+        for (const auto& r : refs) {
+            cb = merge(cb, r.b.center());
+        }
+        const auto objectBin = [&](const Ref& r, int ax) {
+            const auto w = cb.ma[ax] - cb.mi[ax];
+            return glm::clamp(int(bins_ * (r.b.center()[ax] - cb.mi[ax]) / w), 0, bins_ - 1);
+        };
+        RefSplit os;
+        for (int a = 0; a < 3; a++) {
+            if (cb.ma[a] - cb.mi[a] <= 0_f) {
+                continue;
+            }
+            std::fill(bins.begin(), bins.end(), RefBin{ Bound(), 0, 0 });
+            for (const auto& r : refs) {
+                auto& bin = bins[objectBin(r, a)];
+                bin.b = merge(bin.b, r.b);
+                bin.enter++;
+                bin.exit++;
+            }
+            sweepBins(bins, a, nb, os);
+        }
+
+        // Find the best spatial split by binning the clipped references
+        // if the children of the object split overlap significantly
+        RefSplit ss;
+        const auto overlap = os.axis < 0 ? Inf : intersectBound(os.bl, os.br).surfaceArea();
+        const auto spatialPos = [&](int j, int ax) {
+            return nb.mi[ax] + (nb.ma[ax] - nb.mi[ax]) * j / bins_;
+        };
+        if (overlap > minOverlap && numRefs < maxRefs) {
+            for (int a = 0; a < 3; a++) {
+                const auto w = nb.ma[a] - nb.mi[a];
+                if (w <= 0_f) {
+                    continue;
+                }
+                const auto spatialBin = [&](Float x) {
+                    return glm::clamp(int(bins_ * (x - nb.mi[a]) / w), 0, bins_ - 1);
+                };
+                std::fill(bins.begin(), bins.end(), RefBin{ Bound(), 0, 0 });
+                for (const auto& r : refs) {
+                    const int f = spatialBin(r.b.mi[a]);
+                    const int l = spatialBin(r.b.ma[a]);
+                    bins[f].enter++;
+                    bins[l].exit++;
+                    auto curr = r;
+                    for (int j = f; j < l; j++) {
+                        const auto [cl, cr] = clipRef(splitPrimitive, curr, a, spatialPos(j + 1, a));
+                        bins[j].b = merge(bins[j].b, cl.b);
+                        curr = cr;
+                    }
+                    bins[l].b = merge(bins[l].b, curr.b);
+                }
+                sweepBins(bins, a, nb, ss);
+            }
+        }
+
+        // Make a leaf if it is cheaper than both splits
+        if (std::min(os.cost, ss.cost) > leafCost(n)) {
+            return -1;
+        }
+
+        // Partition the references by the spatial split.
+        // The references straddling the plane are duplicated only if it is cheaper than
+        // putting the whole reference into either side (reference unsplitting).
+        // The number of straddling references is reserved in advance to respect the budget.
+        if (ss.cost < os.cost) {
+            const int a = ss.axis;
+            const auto pos = spatialPos(ss.bin, a);
+            int nl = 0, nr = 0, straddling = 0;
+            for (const auto& r : refs) {
+                if (r.b.ma[a] <= pos) {
+                    nl++;
+                }
+                else if (r.b.mi[a] >= pos) {
+                    nr++;
+                }
+                else {
+                    nl++;
+                    nr++;
+                    straddling++;
+                }
+            }
+            if (numRefs.fetch_add(straddling) + straddling <= maxRefs) {
+                auto bl = ss.bl, br = ss.br;
+                int dup = 0;
+                for (const auto& r : refs) {
+                    if (r.b.ma[a] <= pos) {
+                        left.push_back(r);
+                    }
+                    else if (r.b.mi[a] >= pos) {
+                        right.push_back(r);
+                    }
+                    else {
+                        const auto cs = bl.surfaceArea()*nl + br.surfaceArea()*nr;
+                        const auto c1 = nr > 1 ? merge(bl, r.b).surfaceArea()*nl + br.surfaceArea()*(nr-1) : Inf;
+                        const auto c2 = nl > 1 ? bl.surfaceArea()*(nl-1) + merge(br, r.b).surfaceArea()*nr : Inf;
+                        if (c1 < cs && c1 <= c2) {
+                            left.push_back(r);
+                            bl = merge(bl, r.b);
+                            nr--;
+                        }
+                        else if (c2 < cs) {
+                            right.push_back(r);
+                            br = merge(br, r.b);
+                            nl--;
+                        }
+                        else {
+                            const auto [cl, cr] = clipRef(splitPrimitive, r, a, pos);
+                            if (cl.b.mi.x <= cl.b.ma.x) {
+                                left.push_back(cl);
+                            }
+                            if (cr.b.mi.x <= cr.b.ma.x) {
+                                right.push_back(cr);
+                            }
+                            dup++;
+                        }
+                    }
+                }
+                numRefs -= straddling - dup;
+                if (!left.empty() && !right.empty()) {
+                    return a;
+                }
+                numRefs -= dup;
+                left.clear();
+                right.clear();
+            }
+            else {
+                numRefs -= straddling;
+            }
+            if (os.axis < 0) {
+                return -1;
+            }
+        }
+
+        // Partition the references by the object split
+        for (const auto& r : refs) {
+            (objectBin(r, os.axis) < os.bin ? left : right).push_back(r);
+        }
+        return os.axis;
+    }
+
+public:
+    // Builds the BVH and returns the memory in bytes used for the nodes during the build.
+    // The subtrees are built by the tasks of the parallel context.
+    size_t build(BVH& bvh) {
+        const int np = int(bs_.size()); // Number of primitives
+        bvh.nodes.clear();
+        if (np == 0) {
+            return 0;
+        }
+        std::vector<Node> nodes(2*np-1);// Maximum number of nodes: 2*np-1
+        indices_.assign(np, 0);
+        std::iota(indices_.begin(), indices_.end(), 0);
+        std::atomic<int> nn = 1;        // Number of current nodes
+
+        // Constructs the node for the primitives in [s,e) and the subtree below it
+        std::function<void(int, int, int, int, const parallel::SpawnTaskFunc&)> process = [&](int ni, int s, int e, int depth, const parallel::SpawnTaskFunc& spawn) {
+            // Calculate the bound for the node
+            Node& n = nodes[ni];
+            for (int i = s; i < e; i++) {
+                n.b = merge(n.b, bs_[indices_[i]]);
+            }
+
+            // Create a leaf node if the primitives fit in a block
+            // or the depth reaches the limit of the traversal stack
+            const auto m = e - s <= blockSize_ || depth + 1 >= MaxDepth
+                ? std::nullopt
+                : binned_ ? splitByBinning(s, e, n.b) : splitByFullSort(s, e, n.b);
+            if (!m) {
+                n.leaf = 1;
+                n.s = s;
+                n.e = e;
+                return;
+            }
+
+            // Process the children. Small subtrees are processed in the current task.
+            n.axis = m->axis;
+            n.c1 = nn++;
+            n.c2 = nn++;
+            const int c1 = n.c1, c2 = n.c2, mi = m->m;
+            if (e - s < MinTaskSize) {
+                process(c1, s, mi, depth + 1, spawn);
+                process(c2, mi, e, depth + 1, spawn);
+                return;
+            }
+            spawn([&, c1, s, mi, depth]() { process(c1, s, mi, depth + 1, spawn); });
+            spawn([&, c2, mi, e, depth]() { process(c2, mi, e, depth + 1, spawn); });
+        };
+        parallel::tasks([&](const parallel::SpawnTaskFunc& spawn) {
+            process(0, 0, np, 0, spawn);
+        });
+
+        // Linearize the nodes.
+        // The storage of the nodes allocated for the worst case is released on return.
+        linearize(bvh, nodes, nn);
+        return nodes.capacity() * sizeof(Node);
+    }
+
+    // Builds the BVH with spatial splits [Stich2009].
+    // The references to the primitives straddling the split plane are clipped by splitPrimitive,
+    // thus a primitive might be referenced from multiple leaves.
+    // Spatial splits are only evaluated for the nodes whose children of the object split overlap
+    // more than alpha times the surface area of the root,
+    // and the number of references is limited to maxDupRatio times the number of primitives.
+    // Returns the memory in bytes used for the nodes during the build.
+    size_t buildSpatial(BVH& bvh, const SplitPrimitiveFunc& splitPrimitive, Float alpha, Float maxDupRatio) {
+        const int np = int(bs_.size()); // Number of primitives
+        bvh.nodes.clear();
+        indices_.clear();
+        if (np == 0) {
+            return 0;
+        }
+        const int maxRefs = std::max(np, int(np * maxDupRatio));
+        std::vector<Node> nodes(2*maxRefs-1);   // Maximum number of nodes: 2*maxRefs-1
+        indices_.assign(maxRefs, 0);
+        std::vector<Ref> rootRefs;
+        rootRefs.reserve(np);
+        Bound rootBound;
+        for (int i = 0; i < np; i++) {
+            rootRefs.push_back({ bs_[i], i });
+            rootBound = merge(rootBound, bs_[i]);
+        }
+        scratchMem_.add(np * sizeof(Ref));
+        const Float minOverlap = alpha * rootBound.surfaceArea();
+        std::atomic<int> numRefs = np;          // Number of references
+        std::atomic<int> numIndices = 0;        // Number of primitive indices output by the leaves
+        std::atomic<int> nn = 1;                // Number of current nodes
+
+        // Constructs the node for the references and the subtree below it
+        std::function<void(int, std::vector<Ref>&, int, const parallel::SpawnTaskFunc&)> process = [&](int ni, std::vector<Ref>& refs, int depth, const parallel::SpawnTaskFunc& spawn) {
+            // Calculate the bound for the node
+            Node& n = nodes[ni];
+            for (const auto& r : refs) {
+                n.b = merge(n.b, r.b);
+            }
+
+            // Create a leaf node or split the references
+            auto left = std::make_shared<std::vector<Ref>>();
+            auto right = std::make_shared<std::vector<Ref>>();
+            const int axis = int(refs.size()) <= blockSize_ || depth + 1 >= MaxDepth
+                ? -1 : splitReferences(refs, n.b, *left, *right, splitPrimitive, minOverlap, numRefs, maxRefs);
+            scratchMem_.add((left->size() + right->size()) * sizeof(Ref));
+            scratchMem_.sub(refs.size() * sizeof(Ref));
+            if (axis < 0) {
+                n.leaf = 1;
+                n.s = numIndices.fetch_add(int(refs.size()));
+                n.e = n.s + int(refs.size());
+                for (int i = n.s; i < n.e; i++) {
+                    indices_[i] = refs[i - n.s].i;
+                }
+                refs = std::vector<Ref>();
+                return;
+            }
+            refs = std::vector<Ref>();
+
+            // Process the children. Small subtrees are processed in the current task.
+            n.axis = axis;
+            n.c1 = nn++;
+            n.c2 = nn++;
+            const int c1 = n.c1, c2 = n.c2;
+            if (int(left->size() + right->size()) < MinTaskSize) {
+                process(c1, *left, depth + 1, spawn);
+                process(c2, *right, depth + 1, spawn);
+                return;
+            }
+            spawn([&, c1, left, depth]() { process(c1, *left, depth + 1, spawn); });
+            spawn([&, c2, right, depth]() { process(c2, *right, depth + 1, spawn); });
+        };
+        parallel::tasks([&](const parallel::SpawnTaskFunc& spawn) {
+            process(0, rootRefs, 0, spawn);
+        });
+        indices_.resize(numIndices);
+
+        // Linearize the nodes
+        linearize(bvh, nodes, nn);
+        return nodes.capacity() * sizeof(Node);
+    }
+
+    // Builds the BVH by sorting the primitives along Morton curve (LBVH) [Karras2012].
+    // The hierarchy is emitted from the highest differing bits of the sorted Morton codes
+    // independently for each interior node, thus the build is linear in the number of primitives
+    // except for sorting. The subtrees with the primitives fitting in a block are collapsed to leaves.
+    // Returns the memory in bytes used for the nodes during the build.
+    size_t buildLinear(BVH& bvh) {
+        const int np = int(bs_.size()); // Number of primitives
+        bvh.nodes.clear();
+        if (np == 0) {
+            return 0;
+        }
+        const int nt = std::max(1, std::min(parallel::numThreads(), np / MinTaskSize + 1));
+
+        // Compute Morton codes of the centers
+        Bound cb;
+        for (const auto& c : cs_) {
+            cb = merge(cb, c);
+        }
+        ScratchBuffer<uint64_t> codes(scratchMem_, np);
+        ScratchBuffer<uint64_t> codesTmp(scratchMem_, np);
+        ScratchBuffer<int> indicesTmp(scratchMem_, np);
+        indices_.assign(np, 0);
+        parallelChunks(np, nt, [&](int, int s, int e) {
+            for (int i = s; i < e; i++) {
+                codes[i] = mortonCode(cs_[i], cb);
+                indices_[i] = i;
+            }
+        });
+
+        // Sort the codes by LSD radix sort with 11-bit digits.
+        // Each pass counts the digits per chunk and scatters the chunks in parallel.
+        // The passes where all codes share the digit are skipped.
+        constexpr int DigitBits = 11;
+        constexpr int NumDigits = 1 << DigitBits;
+        auto* ks = &codes[0];
+        auto* is = indices_.data();
+        auto* kt = &codesTmp[0];
+        auto* it = &indicesTmp[0];
+        std::vector<std::array<int, NumDigits>> counts(nt);
+        for (int shift = 0; shift < 3 * MortonBits; shift += DigitBits) {
+            parallelChunks(np, nt, [&](int t, int s, int e) {
+                auto& c = counts[t];
+                c.fill(0);
+                for (int i = s; i < e; i++) {
+                    c[(ks[i] >> shift) & (NumDigits - 1)]++;
+                }
+            });
+            const bool skip = [&]() {
+                const int d = (ks[0] >> shift) & (NumDigits - 1);
+                int n = 0;
+                for (const auto& c : counts) {
+                    n += c[d];
+                }
+                return n == np;
+            }();
+            if (skip) {
+                continue;
+            }
+            int offset = 0;
+            for (int d = 0; d < NumDigits; d++) {
+                for (auto& c : counts) {
+                    const int n = c[d];
+                    c[d] = offset;
+                    offset += n;
+                }
+            }
+            parallelChunks(np, nt, [&](int t, int s, int e) {
+                auto& c = counts[t];
+                for (int i = s; i < e; i++) {
+                    const int j = c[(ks[i] >> shift) & (NumDigits - 1)]++;
+                    kt[j] = ks[i];
+                    it[j] = is[i];
+                }
+            });
+            std::swap(ks, kt);
+            std::swap(is, it);
+        }
+        if (is != indices_.data()) {
+            std::copy(is, is + np, indices_.begin());
+        }
+
+        // Length of the common prefix of the codes at i and j, or -1 if j is out of range.
+        // Duplicated codes are distinguished by the indices.
+        auto delta = [&](int i, int j) -> int {
+            if (j < 0 || j >= np) {
+                return -1;
+            }
+            const auto x = ks[i] ^ ks[j];
+            return x ? countLeadingZeros(x) : 64 + countLeadingZeros(uint64_t(i ^ j));
+        };
+
+        // Determine the range and children of each interior node.
+        // Children are interior nodes if non-negative, otherwise leaf ~k for the k-th primitive.
+        struct RadixNode {
+            int first, last;    // Range of the sorted primitives
+            int c1, c2;         // Children
+        };
+        ScratchBuffer<RadixNode> rnodes(scratchMem_, np - 1);
+        parallelChunks(np - 1, nt, [&](int, int s, int e) {
+            for (int i = s; i < e; i++) {
+                // Direction of the range
+                const int d = delta(i, i + 1) - delta(i, i - 1) > 0 ? 1 : -1;
+
+                // Find the other end of the range by exponential and binary search
+                const int dmin = delta(i, i - d);
+                int lmax = 2;
+                while (delta(i, i + lmax * d) > dmin) {
+                    lmax *= 2;
+                }
+                int l = 0;
+                for (int t = lmax / 2; t >= 1; t /= 2) {
+                    if (delta(i, i + (l + t) * d) > dmin) {
+                        l += t;
+                    }
+                }
+                const int j = i + l * d;
+
+                // Find the split position by binary search
+                const int dnode = delta(i, j);
+                int sp = 0;
+                for (int div = 2, t = l; t > 1; div *= 2) {
+                    t = (l + div - 1) / div;
+                    if (delta(i, i + (sp + t) * d) > dnode) {
+                        sp += t;
+                    }
+                }
+                const int g = i + sp * d + std::min(d, 0);
+                auto& rn = rnodes[i];
+                rn.first = std::min(i, j);
+                rn.last = std::max(i, j);
+                rn.c1 = rn.first == g ? ~g : g;
+                rn.c2 = rn.last == g + 1 ? ~(g + 1) : g + 1;
+            }
+        });
+
+        // Convert to the nodes collapsing the small subtrees to leaves.
+        // Children are always placed after their parents.
+        std::vector<Node> nodes;
+        nodes.reserve(2 * ((np + blockSize_ - 1) / blockSize_) - 1);
+        struct Entry {
+            int radixNode;  // Index of the radix tree node
+            int index;      // Index of the node
+            int depth;      // Depth of the node
+        };
+        std::vector<Entry> stack;
+        nodes.emplace_back();
+        stack.push_back({ np > 1 ? 0 : ~0, 0, 0 });
+        while (!stack.empty()) {
+            const auto [ri, ni, depth] = stack.back();
+            stack.pop_back();
+            const int first = ri >= 0 ? rnodes[ri].first : ~ri;
+            const int last = ri >= 0 ? rnodes[ri].last : ~ri;
+            if (last - first + 1 <= blockSize_ || depth + 1 >= MaxDepth) {
+                nodes[ni].leaf = 1;
+                nodes[ni].s = first;
+                nodes[ni].e = last + 1;
+                continue;
+            }
+            // The split axis is the axis of the highest differing bit
+            const auto x = ks[first] ^ ks[last];
+            nodes[ni].axis = x ? (63 - countLeadingZeros(x)) % 3 : 0;
+            const auto& rn = rnodes[ri];
+            nodes[ni].c1 = int(nodes.size());
+            nodes.emplace_back();
+            nodes[ni].c2 = int(nodes.size());
+            nodes.emplace_back();
+            stack.push_back({ rn.c2, nodes[ni].c2, depth + 1 });
+            stack.push_back({ rn.c1, nodes[ni].c1, depth + 1 });
+        }
+
+        // Compute the bounds of the leaves in parallel and then the interior nodes from the bottom
+        parallelChunks(int(nodes.size()), nt, [&](int, int s, int e) {
+            for (int i = s; i < e; i++) {
+                auto& n = nodes[i];
+                if (!n.leaf) {
+                    continue;
+                }
+                for (int j = n.s; j < n.e; j++) {
+                    n.b = merge(n.b, bs_[indices_[j]]);
+                }
+            }
+        });
+        for (int i = int(nodes.size()) - 1; i >= 0; i--) {
+            auto& n = nodes[i];
+            if (!n.leaf) {
+                n.b = merge(nodes[n.c1].b, nodes[n.c2].b);
+            }
+        }
+
+        // Linearize the nodes
+        linearize(bvh, nodes, int(nodes.size()));
+        return nodes.capacity() * sizeof(Node);
+    }
+};
+
+LM_NAMESPACE_END(bvh)
+LM_NAMESPACE_END(LM_NAMESPACE)
@@ -25,10 +25,10 @@ LM_NAMESPACE_BEGIN(LM_NAMESPACE)
 */
 class Light_Area final : public Light {
 private:
-    Vec3 Ke_;     // Luminance
-    Dist dist_;   // For surface sampling of area lights
-    Float invA_;  // Inverse area of area lights
-    Mesh* mesh_;  // Underlying mesh
+    Vec3 Ke_;         // Luminance
+    AliasDist dist_;  // For surface sampling of area lights
+    Float invA_;      // Inverse area of area lights
+    Mesh* mesh_;      // Underlying mesh
 
 public:
     LM_SERIALIZE_IMPL(ar) {
@@ -55,20 +55,24 @@ public:
             return false;
         }
         
-        // Construct CDF for surface sampling
-        // Note we construct the CDF before transformation
+        // Construct distribution for surface sampling
+        // Note we construct the distribution before transformation
+        Float A = 0_f;
         mesh_->foreachTriangle([&](int, const Mesh::Tri& tri) {
             const auto cr = cross(tri.p2.p - tri.p1.p, tri.p3.p - tri.p1.p);
-            dist_.add(math::safeSqrt(glm::dot(cr, cr)) * .5_f);
+            const auto a = math::safeSqrt(glm::dot(cr, cr)) * .5_f;
+            dist_.add(a);
+            A += a;
         });
-        invA_ = 1_f / dist_.c.back();
+        invA_ = 1_f / A;
         dist_.norm();
 
         return true;
     }
 
-    virtual std::optional<LightRaySample> sample(Rng& rng, const PointGeometry& geom, const Transform& transform) const override {
-        const int i = dist_.samp(rng);
+private:
+    // Samples a point on the triangle uniformly and transforms it to world space
+    PointGeometry samplePoint(Rng& rng, int i, const Transform& transform) const {
         const auto s = math::safeSqrt(rng.u());
         const auto tri = mesh_->triangleAt(i);
         const auto a = tri.p1.p;
@@ -76,15 +80,25 @@ public:
         const auto c = tri.p3.p;
         const auto p = math::mixBarycentric(a, b, c, Vec2(1_f-s, rng.u()*s));
         const auto n = glm::normalize(glm::cross(b - a, c - a));
-        const auto geomL = PointGeometry::makeOnSurface(
+        return PointGeometry::makeOnSurface(
             transform.M * Vec4(p, 1_f),
             transform.normalM * n);
-        const auto ppL = geomL.p - geom.p;
-        const auto wo = glm::normalize(ppL);
-        const auto pL = pdf(geom, geomL, transform, -wo);
+    }
+
+    // Area of the transformed triangle
+    Float transformedArea(int i, const Transform& transform) const {
+        const auto tri = mesh_->triangleAt(i);
+        const Mat3 M(transform.M);
+        const auto cr = glm::cross(M * (tri.p2.p - tri.p1.p), M * (tri.p3.p - tri.p1.p));
+        return math::safeSqrt(glm::dot(cr, cr)) * .5_f;
+    }
+
+    // Makes the light sample toward the point on the light with the pdf
+    std::optional<LightRaySample> makeSample(const PointGeometry& geom, const PointGeometry& geomL, Float pL) const {
         if (pL == 0_f) {
             return {};
         }
+        const auto wo = glm::normalize(geomL.p - geom.p);
         const auto Le = eval(geomL, -wo);
         return LightRaySample{
             geomL,
@@ -93,6 +107,14 @@ public:
         };
     }
 
+public:
+    virtual std::optional<LightRaySample> sample(Rng& rng, const PointGeometry& geom, const Transform& transform) const override {
+        const int i = dist_.samp(rng);
+        const auto geomL = samplePoint(rng, i, transform);
+        const auto wo = glm::normalize(geomL.p - geom.p);
+        return makeSample(geom, geomL, pdf(geom, geomL, transform, -wo));
+    }
+
     virtual Float pdf(const PointGeometry& geom, const PointGeometry& geomL, const Transform& transform, Vec3) const override {
         const auto G = surface::geometryTerm(geom, geomL);
         return G == 0_f ? 0_f : tranformedInvA(transform) / G;
@@ -106,6 +128,51 @@ public:
         return false;
     }
 
+    virtual Float power(const Transform& transform) const override {
+        // Area of the transformed mesh
+        const Mat3 M(transform.M);
+        Float A = 0_f;
+        mesh_->foreachTriangle([&](int, const Mesh::Tri& tri) {
+            const auto cr = cross(M * (tri.p2.p - tri.p1.p), M * (tri.p3.p - tri.p1.p));
+            A += math::safeSqrt(glm::dot(cr, cr)) * .5_f;
+        });
+        return Pi * glm::compMax(Ke_) * A;
+    }
+
+    // Triangles of the mesh are the elements of the light
+    virtual int numElements() const override {
+        return mesh_->numTriangles();
+    }
+
+    virtual LightBound elementBound(int i, const Transform& transform) const override {
+        const auto tri = mesh_->triangleAt(i);
+        Bound b;
+        for (const auto& p : { tri.p1.p, tri.p2.p, tri.p3.p }) {
+            b = merge(b, Vec3(transform.M * Vec4(p, 1_f)));
+        }
+        const auto n = transform.normalM * glm::cross(tri.p2.p - tri.p1.p, tri.p3.p - tri.p1.p);
+        const auto l = glm::length(n);
+        return LightBound{
+            b,
+            l > 0_f ? n / l : Vec3(0_f, 0_f, 1_f),
+            1_f,
+            0_f,
+            Pi * glm::compMax(Ke_) * transformedArea(i, transform)
+        };
+    }
+
+    virtual std::optional<LightRaySample> sampleElement(Rng& rng, const PointGeometry& geom, const Transform& transform, int i) const override {
+        const auto geomL = samplePoint(rng, i, transform);
+        const auto wo = glm::normalize(geomL.p - geom.p);
+        return makeSample(geom, geomL, pdfElement(geom, geomL, transform, i, -wo));
+    }
+
+    virtual Float pdfElement(const PointGeometry& geom, const PointGeometry& geomL, const Transform& transform, int i, Vec3) const override {
+        const auto G = surface::geometryTerm(geom, geomL);
+        const auto A = transformedArea(i, transform);
+        return G == 0_f || A == 0_f ? 0_f : 1_f / (A * G);
+    }
+
     virtual Vec3 eval(const PointGeometry& geom, Vec3 wo) const override {
         return glm::dot(wo, geom.n) <= 0_f ? Vec3(0_f) : Ke_;
     }
@@ -27,11 +27,16 @@ class Light_Env final : public Light {
 private:
     Component::Ptr<Texture> envmap_;    // Environment map
     Float rot_;                         // Rotation of the environment map around (0,1,0)
-    Dist2 dist_;                        // For sampling directions
+    AliasDist2 dist_;                   // For sampling directions
+    Float power_;                       // Power received by a unit disk
 
 public:
     LM_SERIALIZE_IMPL(ar) {
         ar(envmap_, rot_, dist_);
+        // The power is computed again on load to keep the format of the archives
+        if constexpr (Archive::is_loading::value) {
+            power_ = computePower();
+        }
     }
 
     virtual void foreachUnderlying(const ComponentVisitor& visitor) override {
@@ -61,9 +66,26 @@ public:
             ls[i] = glm::compMax(v) * std::sin(Pi * (Float(i) / w + .5_f) / h);
         }
         dist_.init(ls, w, h);
+        power_ = computePower();
         return true;
     }
 
+private:
+    // Computes the power received by a unit disk
+    Float computePower() const {
+        const auto [w, h] = envmap_->size();
+        Float power = 0_f;
+        for (int y = 0; y < h; y++) {
+            for (int x = 0; x < w; x++) {
+                // Solid angle of the pixel is sin(theta) * (2pi/w) * (pi/h)
+                const auto v = envmap_->evalByPixelCoords(x, y);
+                power += glm::compMax(v) * std::sin(Pi * (y + .5_f) / h) * 2_f * Pi * Pi / (w * h);
+            }
+        }
+        return power * Pi;
+    }
+
+public:
     virtual std::optional<LightRaySample> sample(Rng& rng, const PointGeometry& geom, const Transform&) const override {
         const auto u = dist_.samp(rng);
         const auto t  = Pi * u[1];
@@ -107,6 +129,10 @@ public:
         return true;
     }
 
+    virtual Float power(const Transform&) const override {
+        return power_;
+    }
+
     virtual Vec3 eval(const PointGeometry& geom, Vec3) const override {
         const auto d = -geom.wo;
         const auto at = [&]() {
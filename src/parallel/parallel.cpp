@@ -30,4 +30,8 @@ LM_PUBLIC_API void foreach(long long numSamples, const ParallelProcessFunc& proc
     Instance::get().foreach(numSamples, processFunc);
 }
 
+LM_PUBLIC_API void tasks(const TaskGroupFunc& func) {
+    Instance::get().tasks(func);
+}
+
 LM_NAMESPACE_END(LM_NAMESPACE::parallel)
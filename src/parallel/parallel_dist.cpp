@@ -107,6 +107,9 @@ public:
         std::unique_lock<std::mutex> lock(mut);
         cond.wait(lock, [&] { return done; });
     }
+    virtual void tasks(const TaskGroupFunc& func) const override {
+        localContext_->tasks(func);
+    }
 };
 
 LM_COMP_REG_IMPL(ParallelContext_DistWorker, "parallel::distworker");
@@ -89,6 +89,45 @@ public:
             std::rethrow_exception(exp);
         }
     }
+
+    virtual void tasks(const TaskGroupFunc& func) const override {
+        // Captured exceptions inside the tasks
+        std::atomic<bool> done = false;
+        std::exception_ptr exp;
+        std::mutex explock;
+        const auto run = [&](const TaskFunc& task) {
+            try {
+                task();
+            }
+            catch (...) {
+                std::unique_lock<std::mutex> lock(explock);
+                exp = std::current_exception();
+                done = true;
+            }
+        };
+
+        // Spawn an OpenMP task, which is scheduled by the work-stealing scheduler of the runtime.
+        // The implicit barrier at the end of the parallel region waits for all tasks
+        // including the ones spawned by the other tasks.
+        const SpawnTaskFunc spawn = [&](const TaskFunc& task) {
+            if (done) {
+                return;
+            }
+            TaskFunc t = task;
+            #pragma omp task firstprivate(t)
+            run(t);
+        };
+        #pragma omp parallel
+        {
+            #pragma omp single
+            run([&]() { func(spawn); });
+        }
+
+        // Rethrow exception if available
+        if (exp) {
+            std::rethrow_exception(exp);
+        }
+    }
 };
 
 LM_COMP_REG_IMPL(ParallelContext_OpenMP, "parallel::openmp");
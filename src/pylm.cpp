@@ -223,6 +223,7 @@ static void bind(pybind11::module& m) {
     m.def("groupNode", &groupNode);
     m.def("instanceGroupNode", &instanceGroupNode);
     m.def("transformNode", &transformNode);
+    m.def("setTransform", &setTransform);
     m.def("addChild", &addChild);
     m.def("primitive", &primitive);
     #pragma endregion
@@ -469,7 +470,18 @@ static void bind(pybind11::module& m) {
         .def_readwrite("primitive", &SceneInteraction::primitive)
         .def_readwrite("comp", &SceneInteraction::comp)
         .def_readwrite("geom", &SceneInteraction::geom)
-        .def_readwrite("endpoint", &SceneInteraction::endpoint);
+        .def_readwrite("endpoint", &SceneInteraction::endpoint)
+        .def_readwrite("face", &SceneInteraction::face);
+
+    pybind11::class_<SceneHit>(m, "SceneHit")
+        .def(pybind11::init<>())
+        .def_readwrite("primitive", &SceneHit::primitive)
+        .def_readwrite("face", &SceneHit::face)
+        .def_readwrite("t", &SceneHit::t)
+        .def_readwrite("uv", &SceneHit::uv)
+        .def_readwrite("d", &SceneHit::d)
+        .def_readwrite("infinite", &SceneHit::infinite)
+        .def_readwrite("light", &SceneHit::light);
 
     {
         auto sm = m.def_submodule("surface");
@@ -511,6 +523,9 @@ static void bind(pybind11::module& m) {
         virtual void addChildFromModel(int parent, const std::string& modelLoc) override {
             PYBIND11_OVERLOAD_PURE(void, Scene, addChildFromModel, parent, modelLoc);
         }
+        virtual void setTransform(int nodeIndex, Mat4 transform) override {
+            PYBIND11_OVERLOAD_PURE(void, Scene, setTransform, nodeIndex, transform);
+        }
         virtual void traverseNodes(const NodeTraverseFunc& traverseFunc) const override {
             PYBIND11_OVERLOAD_PURE(void, Scene, traverseNodes, traverseFunc);
         }
@@ -520,12 +535,36 @@ static void bind(pybind11::module& m) {
         virtual const SceneNode& nodeAt(int nodeIndex) const override {
             PYBIND11_OVERLOAD_PURE(const SceneNode&, Scene, nodeAt, nodeIndex);
         }
+        virtual int numChildren(int nodeIndex) const override {
+            PYBIND11_OVERLOAD_PURE(int, Scene, numChildren, nodeIndex);
+        }
+        virtual int childAt(int nodeIndex, int i) const override {
+            PYBIND11_OVERLOAD_PURE(int, Scene, childAt, nodeIndex, i);
+        }
+        virtual const Mat4& transformAt(int transformIndex) const override {
+            PYBIND11_OVERLOAD_PURE(const Mat4&, Scene, transformAt, transformIndex);
+        }
+        virtual int numPrimitiveInstances() const override {
+            PYBIND11_OVERLOAD_PURE(int, Scene, numPrimitiveInstances);
+        }
+        virtual const PrimitiveInstance& primitiveInstanceAt(int index) const override {
+            PYBIND11_OVERLOAD_PURE(const PrimitiveInstance&, Scene, primitiveInstanceAt, index);
+        }
         virtual void build(const std::string& name, const Json& prop) override {
             PYBIND11_OVERLOAD_PURE(void, Scene, build, name, prop);
         }
+        virtual std::optional<SceneHit> intersectHit(Ray ray, Float tmin, Float tmax) const override {
+            PYBIND11_OVERLOAD_PURE(std::optional<SceneHit>, Scene, intersectHit, ray, tmin, tmax);
+        }
+        virtual SceneInteraction interaction(const SceneHit& hit) const override {
+            PYBIND11_OVERLOAD_PURE(SceneInteraction, Scene, interaction, hit);
+        }
         virtual std::optional<SceneInteraction> intersect(Ray ray, Float tmin, Float tmax) const override {
             PYBIND11_OVERLOAD_PURE(std::optional<SceneInteraction>, Scene, intersect, ray, tmin, tmax);
         }
+        virtual bool occluded(Ray ray, Float tmin, Float tmax) const override {
+            PYBIND11_OVERLOAD_PURE(bool, Scene, occluded, ray, tmin, tmax);
+        }
         virtual bool isLight(const SceneInteraction& sp) const override {
             PYBIND11_OVERLOAD_PURE(bool, Scene, isLight, sp);
         }
@@ -573,9 +612,13 @@ static void bind(pybind11::module& m) {
         .def("createNode", &Scene::createNode)
         .def("addChild", &Scene::addChild)
         .def("addChildFromModel", &Scene::addChildFromModel)
+        .def("setTransform", &Scene::setTransform)
         .def("traverseNodes", &Scene::traverseNodes)
         .def("build", &Scene::build)
         .def("intersect", &Scene::intersect, "ray"_a = Ray{}, "tmin"_a = Eps, "tmax"_a = Inf)
+        .def("occluded", &Scene::occluded, "ray"_a = Ray{}, "tmin"_a = Eps, "tmax"_a = Inf)
+        .def("intersectHit", &Scene::intersectHit, "ray"_a = Ray{}, "tmin"_a = Eps, "tmax"_a = Inf)
+        .def("interaction", &Scene::interaction)
         .def("isLight", &Scene::isLight)
         .def("isSpecular", &Scene::isSpecular)
         .def("primaryRay", &Scene::primaryRay)
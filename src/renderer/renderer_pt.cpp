@@ -94,21 +94,24 @@ public:
                         L += throughput * fs * sL->weight * misw;
                     }();
 
-                    // Intersection to next surface
-                    const auto hit = scene->intersect(s->ray());
+                    // Intersection to next surface.
+                    // The surface interaction is computed only if the hit is a light or the path continues.
+                    const auto hit = scene->intersectHit(s->ray());
                     if (!hit) {
                         break;
                     }
+                    std::optional<SceneInteraction> spHit;
 
                     // Update throughput
                     throughput *= s->weight;
 
                     // Accumulate contribution from light
-                    if (scene->isLight(*hit)) {
+                    if (hit->light) {
+                        spHit = scene->interaction(*hit);
                         const auto woL = -s->wo;
-                        const auto fs = scene->evalContrbEndpoint(*hit, woL);
+                        const auto fs = scene->evalContrbEndpoint(*spHit, woL);
                         const auto misw = !nee ? 1_f : math::balanceHeuristic(
-                            scene->pdf(s->sp, wi, s->wo), scene->pdfLight(s->sp, *hit, woL));
+                            scene->pdf(s->sp, wi, s->wo), scene->pdfLight(s->sp, *spHit, woL));
                         L += throughput * fs * misw;
                     }
 
@@ -122,8 +125,11 @@ public:
                     }
 
                     // Update
+                    if (length + 1 == maxLength_) {
+                        break;
+                    }
                     wi = -s->wo;
-                    sp = *hit;
+                    sp = spHit ? *spHit : scene->interaction(*hit);
                     sampleRay = [&]() {
                         return scene->sampleRay(rng, sp, wi);
                     };
@@ -73,15 +73,18 @@ public:
                     // Update throughput
                     throughput *= s->weight;
 
-                    // Intersection to next surface
-                    const auto hit = scene->intersect(s->ray());
+                    // Intersection to next surface.
+                    // The surface interaction is computed only if the hit is a light or the path continues.
+                    const auto hit = scene->intersectHit(s->ray());
                     if (!hit) {
                         break;
                     }
+                    std::optional<SceneInteraction> spHit;
 
                     // Accumulate contribution from light
-                    if (scene->isLight(*hit)) {
-                        L += throughput * scene->evalContrbEndpoint(*hit, -s->wo);
+                    if (hit->light) {
+                        spHit = scene->interaction(*hit);
+                        L += throughput * scene->evalContrbEndpoint(*spHit, -s->wo);
                     }
 
                     // Russian roulette
@@ -94,7 +97,10 @@ public:
                     }
 
                     // Update
-                    sampleRay = [&, wi = -s->wo, sp = *hit]() {
+                    if (length + 1 == maxLength_) {
+                        break;
+                    }
+                    sampleRay = [&, wi = -s->wo, sp = spHit ? *spHit : scene->interaction(*hit)]() {
                         return scene->sampleRay(rng, sp, wi);
                     };
                 }
@@ -17,6 +17,7 @@
 #include <lm/json.h>
 #include <lm/medium.h>
 #include <lm/phase.h>
+#include <lm/parallel.h>
 
 LM_NAMESPACE_BEGIN(LM_NAMESPACE)
 
@@ -30,37 +31,392 @@ struct LightPrimitiveIndex {
     }
 };
 
+// Primitive in the compiled scene.
+// The references of a primitive node are copied to a dense table indexed by node indices
+// so that the hot paths touch a single cache line per primitive.
+struct alignas(64) CompiledPrimitive {
+    Mesh* mesh = nullptr;           // Underlying mesh
+    Material* material = nullptr;   // Underlying material
+    Light* light = nullptr;         // Underlying light
+    Camera* camera = nullptr;       // Underlying camera
+    Medium* medium = nullptr;       // Underlying medium
+    int lightIndex = -1;            // Light index (-1 if not a light)
+
+    template <typename Archive>
+    void serialize(Archive& ar) {
+        ar(mesh, material, light, camera, medium, lightIndex);
+    }
+};
+
+// ----------------------------------------------------------------------------
+
+// Cosine of the difference of the angles clamped to zero angle
+Float cosSubClamped(Float sinA, Float cosA, Float sinB, Float cosB) {
+    return cosA > cosB ? 1_f : cosA * cosB + sinA * sinB;
+}
+
+// Sine of the difference of the angles clamped to zero angle
+Float sinSubClamped(Float sinA, Float cosA, Float sinB, Float cosB) {
+    return cosA > cosB ? 0_f : sinA * cosB - cosA * sinB;
+}
+
+// Merges two light bounds. The cones of the normals are merged into the cone containing both.
+LightBound mergeLightBound(const LightBound& a, const LightBound& b) {
+    LightBound r;
+    r.bound = merge(a.bound, b.bound);
+    r.cosThetaE = std::min(a.cosThetaE, b.cosThetaE);
+    r.power = a.power + b.power;
+    const auto thetaA = std::acos(glm::clamp(a.cosThetaO, -1_f, 1_f));
+    const auto thetaB = std::acos(glm::clamp(b.cosThetaO, -1_f, 1_f));
+    const auto thetaD = std::acos(glm::clamp(glm::dot(a.axis, b.axis), -1_f, 1_f));
+    if (std::min(thetaD + thetaB, Pi) <= thetaA) {
+        r.axis = a.axis;
+        r.cosThetaO = a.cosThetaO;
+        return r;
+    }
+    if (std::min(thetaD + thetaA, Pi) <= thetaB) {
+        r.axis = b.axis;
+        r.cosThetaO = b.cosThetaO;
+        return r;
+    }
+    const auto thetaO = (thetaA + thetaD + thetaB) * .5_f;
+    const auto k = glm::cross(a.axis, b.axis);
+    const auto kl = glm::length(k);
+    if (thetaO >= Pi || kl == 0_f) {
+        r.axis = a.axis;
+        r.cosThetaO = -1_f;
+        return r;
+    }
+    // Rotate the axis of a toward b around k
+    const auto thetaR = thetaO - thetaA;
+    r.axis = glm::normalize(a.axis * std::cos(thetaR) + glm::cross(k / kl, a.axis) * std::sin(thetaR));
+    r.cosThetaO = std::cos(thetaO);
+    return r;
+}
+
+// Conservative importance of the emitters in the light bound for the point [Conty & Kulla 2018]
+Float lightImportance(const LightBound& lb, const PointGeometry& geom) {
+    // Squared distances to the center and the radius of the bounding sphere of the bound
+    const auto pc = geom.p - lb.bound.center();
+    const auto l2 = glm::dot(pc, pc);
+    const auto dg = lb.bound.ma - lb.bound.mi;
+    const auto r2 = glm::dot(dg, dg) * .25_f;
+    const auto d2 = std::max(l2, r2);
+    if (d2 == 0_f) {
+        return lb.power;
+    }
+    const auto wi = l2 > 0_f ? pc / std::sqrt(l2) : lb.axis;
+
+    // Angle between the axis and the direction to the point
+    const auto cosW = glm::dot(lb.axis, wi);
+    const auto sinW = math::safeSqrt(1_f - cosW * cosW);
+
+    // Angle subtended by the bounding sphere of the bound
+    const auto cosB = l2 < r2 ? -1_f : math::safeSqrt(1_f - r2 / d2);
+    const auto sinB = math::safeSqrt(1_f - cosB * cosB);
+
+    // Minimum angle between the normals and the direction to the point
+    const auto sinO = math::safeSqrt(1_f - lb.cosThetaO * lb.cosThetaO);
+    const auto cosX = cosSubClamped(sinW, cosW, sinO, lb.cosThetaO);
+    const auto sinX = sinSubClamped(sinW, cosW, sinO, lb.cosThetaO);
+    const auto cosP = cosSubClamped(sinX, cosX, sinB, cosB);
+    if (cosP <= lb.cosThetaE) {
+        return 0_f;
+    }
+    auto importance = lb.power * cosP / d2;
+
+    // Cosine at the receiver
+    if (!geom.degenerated) {
+        const auto cosI = glm::abs(glm::dot(wi, geom.n));
+        const auto sinI = math::safeSqrt(1_f - cosI * cosI);
+        importance *= cosSubClamped(sinI, cosI, sinB, cosB);
+    }
+    return std::max(importance, 0_f);
+}
+
+// Light hierarchy over emitter elements.
+// Each leaf holds an element, and the tree is traversed stochastically
+// choosing the children in proportion to the importance for the shading point.
+class LightBVH {
+private:
+    struct Node {
+        LightBound lb;  // Bound of the elements under the node
+        int child;      // Index of the second child (interior). The first child is the next node
+        int element;    // Element index (leaf) or -1 (interior)
+
+        template <typename Archive>
+        void serialize(Archive& ar) {
+            ar(lb, child, element);
+        }
+    };
+
+    // Maximum depth of the tree, which limits the size of the trails
+    static constexpr int MaxDepth = 64;
+
+    std::vector<Node> nodes_;
+    std::vector<uint64_t> trails_;  // Path from the root to the leaf per element (bit d: second child at depth d)
+
+public:
+    template <typename Archive>
+    void serialize(Archive& ar) {
+        ar(nodes_, trails_);
+    }
+
+    bool empty() const {
+        return nodes_.empty();
+    }
+
+    // Builds the hierarchy over the bounds of the elements
+    void build(const std::vector<LightBound>& lbs) {
+        nodes_.clear();
+        trails_.assign(lbs.size(), 0);
+        if (lbs.empty()) {
+            return;
+        }
+        std::vector<int> indices(lbs.size());
+        std::iota(indices.begin(), indices.end(), 0);
+        buildNode(lbs, indices, 0, int(indices.size()), 0, 0);
+    }
+
+    // Samples an element. Returns the element index and the probability.
+    std::optional<std::tuple<int, Float>> sample(Rng& rng, const PointGeometry& geom) const {
+        if (nodes_.empty()) {
+            return {};
+        }
+        int index = 0;
+        Float p = 1_f;
+        if (nodes_[0].element >= 0 && lightImportance(nodes_[0].lb, geom) == 0_f) {
+            return {};
+        }
+        while (nodes_[index].element < 0) {
+            const int c1 = index + 1;
+            const int c2 = nodes_[index].child;
+            const auto i1 = lightImportance(nodes_[c1].lb, geom);
+            const auto i2 = lightImportance(nodes_[c2].lb, geom);
+            if (i1 == 0_f && i2 == 0_f) {
+                return {};
+            }
+            const auto p1 = i1 / (i1 + i2);
+            if (rng.u() < p1) {
+                index = c1;
+                p *= p1;
+            }
+            else {
+                index = c2;
+                p *= 1_f - p1;
+            }
+        }
+        return std::make_tuple(nodes_[index].element, p);
+    }
+
+    // Probability to sample the element
+    Float pmf(const PointGeometry& geom, int element) const {
+        if (nodes_.empty()) {
+            return 0_f;
+        }
+        if (nodes_[0].element >= 0) {
+            return lightImportance(nodes_[0].lb, geom) > 0_f ? 1_f : 0_f;
+        }
+        const auto trail = trails_.at(element);
+        int index = 0;
+        Float p = 1_f;
+        for (int depth = 0; nodes_[index].element < 0; depth++) {
+            const int c1 = index + 1;
+            const int c2 = nodes_[index].child;
+            const auto i1 = lightImportance(nodes_[c1].lb, geom);
+            const auto i2 = lightImportance(nodes_[c2].lb, geom);
+            if (i1 == 0_f && i2 == 0_f) {
+                return 0_f;
+            }
+            if (trail & (uint64_t(1) << depth)) {
+                index = c2;
+                p *= i2 / (i1 + i2);
+            }
+            else {
+                index = c1;
+                p *= i1 / (i1 + i2);
+            }
+        }
+        return p;
+    }
+
+private:
+    // Cost of the light bound for the split evaluation,
+    // which accounts for the power, the spread of the directions, and the spatial extent.
+    static Float cost(const LightBound& lb) {
+        const auto thetaO = std::acos(glm::clamp(lb.cosThetaO, -1_f, 1_f));
+        const auto thetaE = std::acos(glm::clamp(lb.cosThetaE, -1_f, 1_f));
+        const auto thetaW = std::min(thetaO + thetaE, Pi);
+        const auto sinO = math::safeSqrt(1_f - lb.cosThetaO * lb.cosThetaO);
+        const auto mOmega = 2_f * Pi * (1_f - lb.cosThetaO) +
+            Pi * .5_f * (2_f * thetaW * sinO - std::cos(thetaO - 2_f * thetaW) - 2_f * thetaO * sinO + lb.cosThetaO);
+        return lb.power * mOmega * lb.bound.surfaceArea();
+    }
+
+    // Builds the subtree over the elements in [s,e). Returns the index of the node.
+    int buildNode(const std::vector<LightBound>& lbs, std::vector<int>& indices, int s, int e, int depth, uint64_t trail) {
+        const int index = int(nodes_.size());
+        nodes_.emplace_back();
+        LightBound lb = lbs[indices[s]];
+        for (int i = s + 1; i < e; i++) {
+            lb = mergeLightBound(lb, lbs[indices[i]]);
+        }
+        nodes_[index].lb = lb;
+        if (e - s == 1) {
+            nodes_[index].element = indices[s];
+            nodes_[index].child = -1;
+            trails_[indices[s]] = trail;
+            return index;
+        }
+        nodes_[index].element = -1;
+
+        // Bound of the centroids
+        Bound cb;
+        for (int i = s; i < e; i++) {
+            cb = merge(cb, lbs[indices[i]].bound.center());
+        }
+        const auto ext = cb.ma - cb.mi;
+        const int maxAxis = ext.x > ext.y && ext.x > ext.z ? 0 : ext.y > ext.z ? 1 : 2;
+
+        // Find the split by binning the centroids along each axis.
+        // The cost is regularized by the ratio of the extents to avoid thin nodes.
+        // Close to the maximum depth, the elements are split at the median to bound the depth.
+        constexpr int NumBins = 12;
+        int bestAxis = -1;
+        int bestBin = -1;
+        Float bestCost = Inf;
+        const auto binOf = [&](int i, int axis) {
+            const auto c = lbs[i].bound.center()[axis];
+            return std::clamp(int((c - cb.mi[axis]) / ext[axis] * NumBins), 0, NumBins - 1);
+        };
+        if (depth < MaxDepth - 16) {
+            for (int axis = 0; axis < 3; axis++) {
+                if (ext[axis] <= 0_f) {
+                    continue;
+                }
+                std::optional<LightBound> bins[NumBins];
+                for (int i = s; i < e; i++) {
+                    auto& bin = bins[binOf(indices[i], axis)];
+                    bin = bin ? mergeLightBound(*bin, lbs[indices[i]]) : lbs[indices[i]];
+                }
+                // Merge the bins after each bin, i.e., the right sides of the splits
+                std::optional<LightBound> right[NumBins];
+                for (int b = NumBins - 2; b >= 0; b--) {
+                    const auto& next = bins[b + 1];
+                    right[b] = right[b + 1] && next ? mergeLightBound(*right[b + 1], *next) : right[b + 1] ? right[b + 1] : next;
+                }
+                const auto kr = ext[maxAxis] / ext[axis];
+                std::optional<LightBound> left;
+                for (int b = 0; b < NumBins - 1; b++) {
+                    if (bins[b]) {
+                        left = left ? mergeLightBound(*left, *bins[b]) : *bins[b];
+                    }
+                    if (!left || !right[b]) {
+                        continue;
+                    }
+                    const auto c = kr * (cost(*left) + cost(*right[b]));
+                    if (c < bestCost) {
+                        bestCost = c;
+                        bestAxis = axis;
+                        bestBin = b;
+                    }
+                }
+            }
+        }
+
+        // Partition the elements
+        int mid = -1;
+        if (bestAxis >= 0) {
+            mid = int(std::partition(indices.begin() + s, indices.begin() + e, [&](int i) {
+                return binOf(i, bestAxis) <= bestBin;
+            }) - indices.begin());
+        }
+        if (mid <= s || mid >= e) {
+            mid = (s + e) / 2;
+            std::nth_element(indices.begin() + s, indices.begin() + mid, indices.begin() + e, [&](int i1, int i2) {
+                return lbs[i1].bound.center()[maxAxis] < lbs[i2].bound.center()[maxAxis];
+            });
+        }
+
+        // Build the children
+        buildNode(lbs, indices, s, mid, depth + 1, trail);
+        const int c2 = buildNode(lbs, indices, mid, e, depth + 1, trail | (uint64_t(1) << depth));
+        nodes_[index].child = c2;
+        return index;
+    }
+};
+
+// ----------------------------------------------------------------------------
+
 class Scene_ final : public Scene {
 private:
     std::vector<SceneNode> nodes_;                  // Scene nodes
+    std::vector<Mat4> transforms_;                  // Local transforms of the groups
+    mutable std::vector<int> childOffsets_;         // Offsets of the children per node (CSR)
+    mutable std::vector<int> children_;             // Children of the nodes (CSR)
+    mutable std::vector<std::pair<int, int>> pendingChildren_;  // Pairs of parent and child not yet merged into CSR arrays
     Ptr<Accel> accel_;                              // Acceleration structure
     std::optional<int> camera_;                     // Camera index
     std::vector<LightPrimitiveIndex> lights_;       // Primitive node indices of lights and global transforms
-    std::unordered_map<int, int> lightIndicesMap_;  // Map from node indices to light indices.
+    std::vector<CompiledPrimitive> compiled_;       // Compiled primitives indexed by node indices
+    std::vector<PrimitiveInstance> primitiveInstances_; // Primitive instances in the flattened scene graph
+    AliasDist lightDist_;                           // Distribution for light selection
+    LightBVH lightTree_;                            // Light hierarchy over the elements of the lights (bvh mode)
+    std::vector<int> lightElementOffsets_;          // Offset of the elements per light in the hierarchy (-1 if not in the hierarchy)
+    std::vector<int> elementLights_;                // Light index per element in the hierarchy
+    Float pTree_ = 0_f;                             // Probability to select the hierarchy
+    std::vector<Bound> instanceBounds_;             // Bounds of the primitive instances (only with the environment light)
+    Bound sceneBound_;                              // Bound of the whole scene (only with the environment light)
     std::optional<int> envLight_;                   // Environment light index
     std::optional<int> medium_;                     // Medium index
+    std::unordered_set<int> dirtyNodes_;            // Nodes added or modified since the last build
+    std::string accelName_;                         // Name of the acceleration structure of the last build
+    Json buildProp_;                                // Property of the last build
+    Json buildReport_;                              // Work done and skipped in the last build
 
 public:
     Scene_() {
         // Index 0 is fixed to the scene group
-        nodes_.push_back(SceneNode::makeGroup(0, false, {}));
+        nodes_.push_back(SceneNode::makeGroup(0, false, -1));
     }
 
 public:
     LM_SERIALIZE_IMPL(ar) {
-        ar(nodes_, accel_, camera_, lights_, lightIndicesMap_, envLight_);
+        compactChildren();
+        ar(nodes_, transforms_, childOffsets_, children_, accel_, camera_, lights_, compiled_, primitiveInstances_, lightDist_, lightTree_, lightElementOffsets_, elementLights_, pTree_, envLight_);
     }
 
     virtual void foreachUnderlying(const ComponentVisitor& visit) override {
         comp::visit(visit, accel_);
         for (auto& node : nodes_) {
             if (node.type == SceneNodeType::Primitive) {
+                // Mark the node as dirty if the references are changed, e.g., by the replacement of the assets
+                const auto prev = node.primitive;
                 comp::visit(visit, node.primitive.mesh);
                 comp::visit(visit, node.primitive.material);
                 comp::visit(visit, node.primitive.light);
                 comp::visit(visit, node.primitive.camera);
+                if (prev.mesh != node.primitive.mesh || prev.material != node.primitive.material ||
+                    prev.light != node.primitive.light || prev.camera != node.primitive.camera) {
+                    dirtyNodes_.insert(node.index);
+                }
             }
         }
+        // Keep the references of the compiled primitives in sync with the nodes on replacement of the assets
+        for (auto& cp : compiled_) {
+            comp::visit(visit, cp.mesh);
+            comp::visit(visit, cp.material);
+            comp::visit(visit, cp.light);
+            comp::visit(visit, cp.camera);
+            comp::visit(visit, cp.medium);
+        }
+    }
+
+    virtual Json underlyingValue(const std::string& query) const override {
+        if (query == "build") {
+            return buildReport_;
+        }
+        return {};
     }
 
     virtual Component* underlying(const std::string& name) const override {
@@ -145,6 +501,7 @@ public:
 
             // Create primitive node
             nodes_.push_back(SceneNode::makePrimitive(index, mesh, material, light, camera, medium));
+            dirtyNodes_.insert(index);
 
             return index;
         }
@@ -153,11 +510,13 @@ public:
         
         if (type == SceneNodeType::Group) {
             const int index = int(nodes_.size());
-            nodes_.push_back(SceneNode::makeGroup(
-                index,
-                json::value<bool>(prop, "instanced", false),
-                json::valueOrNone<Mat4>(prop, "transform")
-            ));
+            int transform = -1;
+            if (const auto M = json::valueOrNone<Mat4>(prop, "transform"); M) {
+                transform = int(transforms_.size());
+                transforms_.push_back(*M);
+            }
+            nodes_.push_back(SceneNode::makeGroup(index, json::value<bool>(prop, "instanced", false), transform));
+            dirtyNodes_.insert(index);
             return index;
         }
 
@@ -178,7 +537,31 @@ public:
             return;
         }
         
-        node.group.children.push_back(child);
+        // The children are merged into the CSR arrays on the next access
+        pendingChildren_.push_back({ parent, child });
+        dirtyNodes_.insert(child);
+    }
+
+    virtual void setTransform(int nodeIndex, Mat4 transform) override {
+        if (nodeIndex < 0 || nodeIndex >= int(nodes_.size())) {
+            LM_ERROR("Missing node index [index='{}'", nodeIndex);
+            return;
+        }
+
+        auto& node = nodes_.at(nodeIndex);
+        if (node.type != SceneNodeType::Group) {
+            LM_ERROR("Setting transform to non-group node [index='{}']", nodeIndex);
+            return;
+        }
+
+        if (node.group.transform < 0) {
+            node.group.transform = int(transforms_.size());
+            transforms_.push_back(transform);
+        }
+        else {
+            transforms_[node.group.transform] = transform;
+        }
+        dirtyNodes_.insert(nodeIndex);
     }
 
     virtual void addChildFromModel(int parent, const std::string& modelLoc) override {
@@ -201,6 +584,7 @@ public:
                 dynamic_cast<Light*>(light),
                 nullptr,
                 nullptr));
+            dirtyNodes_.insert(index);
             addChild(parent, index);
         });
     }
@@ -208,19 +592,24 @@ public:
     // ------------------------------------------------------------------------
 
     virtual void traverseNodes(const NodeTraverseFunc& traverseFunc) const override {
-        std::function<void(int, Mat4)> visit = [&](int index, Mat4 globalTransform) {
+        // Traverse with an explicit stack of node indices and global transforms
+        compactChildren();
+        std::vector<std::pair<int, Mat4>> stack{ { 0, Mat4(1_f) } };
+        while (!stack.empty()) {
+            const auto [index, globalTransform] = stack.back();
+            stack.pop_back();
             const auto& node = nodes_.at(index);
             traverseFunc(node, globalTransform);
             if (node.type == SceneNodeType::Group) {
-                const auto M = node.group.localTransform
-                    ? globalTransform * *node.group.localTransform
+                const auto M = node.group.transform >= 0
+                    ? globalTransform * transforms_[node.group.transform]
                     : globalTransform;
-                for (int child : node.group.children) {
-                    visit(child, M);
+                // Push in reverse order to visit the children in order
+                for (int i = numChildrenCompacted(index) - 1; i >= 0; i--) {
+                    stack.push_back({ children_[childOffsets_[index] + i], M });
                 }
             }
-        };
-        visit(0, Mat4(1_f));
+        }
     }
 
     virtual void visitNode(int nodeIndex, const VisitNodeFunc& visit) const override {
@@ -231,37 +620,410 @@ public:
         return nodes_.at(nodeIndex);
     }
 
+    virtual int numChildren(int nodeIndex) const override {
+        compactChildren();
+        return numChildrenCompacted(nodeIndex);
+    }
+
+    virtual int childAt(int nodeIndex, int i) const override {
+        compactChildren();
+        return children_.at(childOffsets_.at(nodeIndex) + i);
+    }
+
+    virtual const Mat4& transformAt(int transformIndex) const override {
+        return transforms_.at(transformIndex);
+    }
+
+    virtual int numPrimitiveInstances() const override {
+        return int(primitiveInstances_.size());
+    }
+
+    virtual const PrimitiveInstance& primitiveInstanceAt(int index) const override {
+        return primitiveInstances_.at(index);
+    }
+
+private:
+    // Merges the pending children into the CSR arrays.
+    // The children of a node keep the order of addition.
+    // This is called lazily from the accessors, which are not thread-safe while the graph is being modified.
+    void compactChildren() const {
+        if (pendingChildren_.empty()) {
+            return;
+        }
+        const int n = int(nodes_.size());
+        std::vector<int> offsets(n + 1, 0);
+        for (int i = 0; i < n; i++) {
+            offsets[i + 1] = numChildrenCompacted(i);
+        }
+        for (const auto& edge : pendingChildren_) {
+            offsets[edge.first + 1]++;
+        }
+        for (int i = 0; i < n; i++) {
+            offsets[i + 1] += offsets[i];
+        }
+        std::vector<int> children(offsets[n]);
+        std::vector<int> curr(offsets.begin(), offsets.end() - 1);
+        for (int i = 0; i < n; i++) {
+            for (int j = 0; j < numChildrenCompacted(i); j++) {
+                children[curr[i]++] = children_[childOffsets_[i] + j];
+            }
+        }
+        for (const auto& [parent, child] : pendingChildren_) {
+            children[curr[parent]++] = child;
+        }
+        childOffsets_ = std::move(offsets);
+        children_ = std::move(children);
+        pendingChildren_ = {};
+    }
+
+    // Number of children in the CSR arrays.
+    // The nodes created after the last compaction have no entries.
+    int numChildrenCompacted(int nodeIndex) const {
+        if (nodeIndex + 1 >= int(childOffsets_.size())) {
+            return 0;
+        }
+        return childOffsets_[nodeIndex + 1] - childOffsets_[nodeIndex];
+    }
+
+    // Flattens the scene graph into the primitive instances.
+    // The upper levels of the graph are expanded until there are enough subtrees for the threads,
+    // and the subtrees are traversed in parallel with explicit stacks, where the global transforms
+    // are accumulated only for the groups with local transforms. The transforms with the normal matrices
+    // and determinants are then computed once per distinct global transform in parallel.
+    void flattenNodes() {
+        compactChildren();
+
+        // Expand the upper levels of the graph level by level.
+        // A group is replaced by its children, so the order of the primitives is kept.
+        // The entries refer to the global transforms of the upper levels by the negative indices -1-i.
+        const size_t minSubtrees = size_t(4 * std::max(1, parallel::numThreads()));
+        std::vector<Mat4> upperMs{ Mat4(1_f) };                // Distinct global transforms of the upper levels
+        std::vector<std::pair<int, int>> roots{ { 0, -1 } };    // Node index and index of the global transform
+        for (bool expanded = true; expanded && roots.size() < minSubtrees;) {
+            expanded = false;
+            std::vector<std::pair<int, int>> next;
+            for (const auto [index, ti] : roots) {
+                const auto& node = nodes_[index];
+                if (node.type == SceneNodeType::Primitive) {
+                    next.push_back({ index, ti });
+                    continue;
+                }
+                int ci = ti;
+                if (node.group.transform >= 0) {
+                    ci = -1 - int(upperMs.size());
+                    upperMs.push_back(upperMs[-1 - ti] * transforms_[node.group.transform]);
+                }
+                for (int i = 0; i < numChildrenCompacted(index); i++) {
+                    next.push_back({ children_[childOffsets_[index] + i], ci });
+                }
+                expanded = true;
+            }
+            roots = std::move(next);
+        }
+
+        // Traverse the subtrees in parallel chunks of the consecutive entries
+        struct Subtrees {
+            std::vector<Mat4> Ms;                       // Distinct global transforms
+            std::vector<std::pair<int, int>> prims;     // Primitive node index and index of the global transform
+        };
+        const int numChunks = int(std::min(roots.size(), minSubtrees));
+        std::vector<Subtrees> chunks(numChunks);
+        parallel::tasks([&](const parallel::SpawnTaskFunc& spawn) {
+            for (int c = 0; c < numChunks; c++) {
+                spawn([&, c]() {
+                    auto& chunk = chunks[c];
+                    const auto globalTransform = [&](int ti) -> const Mat4& {
+                        return ti < 0 ? upperMs[-1 - ti] : chunk.Ms[ti];
+                    };
+                    std::vector<std::pair<int, int>> stack;
+                    const auto s = roots.begin() + roots.size() * c / numChunks;
+                    const auto e = roots.begin() + roots.size() * (c + 1) / numChunks;
+                    // Push in reverse order to visit the subtrees in order
+                    stack.assign(std::make_reverse_iterator(e), std::make_reverse_iterator(s));
+                    while (!stack.empty()) {
+                        const auto [index, ti] = stack.back();
+                        stack.pop_back();
+                        const auto& node = nodes_[index];
+                        if (node.type == SceneNodeType::Primitive) {
+                            chunk.prims.push_back({ index, ti });
+                            continue;
+                        }
+                        int ci = ti;
+                        if (node.group.transform >= 0) {
+                            const Mat4 M = globalTransform(ti) * transforms_[node.group.transform];
+                            ci = int(chunk.Ms.size());
+                            chunk.Ms.push_back(M);
+                        }
+                        for (int i = numChildrenCompacted(index) - 1; i >= 0; i--) {
+                            stack.push_back({ children_[childOffsets_[index] + i], ci });
+                        }
+                    }
+                });
+            }
+        });
+
+        // Merge the results of the chunks
+        std::vector<Mat4> Ms = std::move(upperMs);
+        std::vector<std::pair<int, int>> prims;
+        for (const auto& chunk : chunks) {
+            const int offset = int(Ms.size());
+            Ms.insert(Ms.end(), chunk.Ms.begin(), chunk.Ms.end());
+            for (const auto [index, ti] : chunk.prims) {
+                prims.push_back({ index, ti < 0 ? -1 - ti : offset + ti });
+            }
+        }
+
+        // Process the range in parallel chunks
+        const auto parallelRange = [](long long n, const std::function<void(long long)>& func) {
+            constexpr long long ChunkSize = 1024;
+            parallel::tasks([&](const parallel::SpawnTaskFunc& spawn) {
+                for (long long s = 0; s < n; s += ChunkSize) {
+                    spawn([&, s]() {
+                        for (long long i = s; i < std::min(n, s + ChunkSize); i++) {
+                            func(i);
+                        }
+                    });
+                }
+            });
+        };
+        std::vector<Transform> Ts(Ms.size());
+        parallelRange(Ms.size(), [&](long long i) {
+            Ts[i] = Transform(Ms[i]);
+        });
+        primitiveInstances_.resize(prims.size());
+        parallelRange(prims.size(), [&](long long i) {
+            primitiveInstances_[i] = { prims[i].first, Ts[prims[i].second] };
+        });
+    }
+
+    // Copies the references of a primitive node to the compiled table
+    void compilePrimitive(const SceneNode& node) {
+        auto& cp = compiled_[node.index];
+        cp = {};
+        if (node.type != SceneNodeType::Primitive) {
+            return;
+        }
+        cp.mesh = node.primitive.mesh;
+        cp.material = node.primitive.material;
+        cp.light = node.primitive.light;
+        cp.camera = node.primitive.camera;
+        cp.medium = node.primitive.medium;
+    }
+
+    // Updates the bounds of the primitive instances and the bound of the whole scene.
+    // The bound of an instance is reused if the node is not modified and the global transform is unchanged.
+    // Returns true if the bound of the scene is changed.
+    bool updateBounds(const std::vector<PrimitiveInstance>& prevInstances, bool full) {
+        std::vector<Bound> bounds(primitiveInstances_.size());
+        for (int i = 0; i < int(primitiveInstances_.size()); i++) {
+            const auto& inst = primitiveInstances_[i];
+            const bool reuse = !full && i < int(prevInstances.size()) && i < int(instanceBounds_.size()) &&
+                prevInstances[i].node == inst.node && dirtyNodes_.count(inst.node) == 0 &&
+                prevInstances[i].globalTransform.M == inst.globalTransform.M;
+            if (reuse) {
+                bounds[i] = instanceBounds_[i];
+                continue;
+            }
+            const auto* mesh = compiled_[inst.node].mesh;
+            if (!mesh) {
+                continue;
+            }
+            mesh->foreachTriangle([&](int, const Mesh::Tri& tri) {
+                for (const auto& p : { tri.p1.p, tri.p2.p, tri.p3.p }) {
+                    bounds[i] = merge(bounds[i], Vec3(inst.globalTransform.M * Vec4(p, 1_f)));
+                }
+            });
+        }
+        Bound bound;
+        for (const auto& b : bounds) {
+            bound = merge(bound, b);
+        }
+        instanceBounds_ = std::move(bounds);
+        const bool changed = bound.mi != sceneBound_.mi || bound.ma != sceneBound_.ma;
+        sceneBound_ = bound;
+        return changed;
+    }
+
+    // Builds the distributions for light selection over lights_.
+    // The power of the environment light is computed with the bound of the scene in sceneBound_.
+    void buildLights(const std::string& lightSelection) {
+        // Update light indices
+        for (auto& cp : compiled_) {
+            cp.lightIndex = -1;
+        }
+        for (int i = 0; i < int(lights_.size()); i++) {
+            compiled_[lights_[i].index].lightIndex = i;
+        }
+
+        // Distribution for light selection.
+        // In power and bvh modes, the lights are selected in proportion to their power.
+        // The power of the environment light is scaled by the area of the disk covering the scene.
+        lightDist_ = {};
+        for (const auto& light : lights_) {
+            if (lightSelection == "uniform") {
+                lightDist_.add(1_f);
+                continue;
+            }
+            const auto* l = compiled_[light.index].light;
+            if (l->isInfinite()) {
+                const auto& b = sceneBound_;
+                const auto r = b.mi.x <= b.ma.x ? glm::length(b.ma - b.mi) * .5_f : 1_f;
+                lightDist_.add(l->power(light.globalTransform) * r * r);
+            }
+            else {
+                lightDist_.add(l->power(light.globalTransform));
+            }
+        }
+        lightDist_.norm();
+
+        // Light hierarchy over the elements of the lights.
+        // The hierarchy is selected with the total probability of the lights in it,
+        // and then an element is selected by traversing the hierarchy.
+        lightTree_ = {};
+        lightElementOffsets_.assign(lights_.size(), -1);
+        elementLights_.clear();
+        pTree_ = 0_f;
+        if (lightSelection == "bvh") {
+            std::vector<LightBound> lbs;
+            for (int i = 0; i < int(lights_.size()); i++) {
+                const auto* l = compiled_[lights_[i].index].light;
+                const int n = l->numElements();
+                if (n == 0) {
+                    continue;
+                }
+                lightElementOffsets_[i] = int(lbs.size());
+                for (int j = 0; j < n; j++) {
+                    lbs.push_back(l->elementBound(j, lights_[i].globalTransform));
+                    elementLights_.push_back(i);
+                }
+                pTree_ += lightDist_.p(i);
+            }
+            lightTree_.build(lbs);
+            LM_INFO("Built light hierarchy [elements='{}']", lbs.size());
+        }
+    }
+
+public:
     // ------------------------------------------------------------------------
 
     virtual void build(const std::string& name, const Json& prop) override {
-        // Update light indices
+        // Strategy of light selection
+        const auto lightSelection = json::value<std::string>(prop, "light_selection", "power");
+        if (lightSelection != "uniform" && lightSelection != "power" && lightSelection != "bvh") {
+            LM_ERROR("Invalid light selection [light_selection='{}']", lightSelection);
+            return;
+        }
+
+        // Build everything from scratch if the configuration is changed.
+        // Otherwise only the work affected by the nodes modified since the last build is done.
+        const bool full = !accel_ || name != accelName_ || prop != buildProp_;
+        buildReport_ = {
+            {"full", full},
+            {"dirty_nodes", dirtyNodes_.size()},
+            {"compile", "skipped"},
+            {"lights", "skipped"},
+            {"accel", "skipped"}
+        };
+        if (!full && dirtyNodes_.empty()) {
+            LM_INFO("Scene is not modified. Skipped building");
+            return;
+        }
+
+        // Compile primitives
+        // The dirty nodes are checked against the lights before and after the compilation
+        // because a node can stop or start being a light by the replacement of the assets.
+        bool dirtyLight = false;
+        if (full) {
+            compiled_.assign(nodes_.size(), {});
+            for (const auto& node : nodes_) {
+                compilePrimitive(node);
+            }
+        }
+        else {
+            compiled_.resize(nodes_.size());
+            for (int index : dirtyNodes_) {
+                dirtyLight = dirtyLight || compiled_[index].light;
+                compilePrimitive(nodes_[index]);
+                dirtyLight = dirtyLight || compiled_[index].light;
+            }
+        }
+        buildReport_["compile"] = full ? "full" : "partial";
+
+        // Flatten the scene graph
+        LM_INFO("Flattening scene");
+        const auto prevInstances = std::move(primitiveInstances_);
+        flattenNodes();
+
+        // Collect lights
         // We keep the global transformation of the light primitive as well as the references.
         // We need to recompute the indices when an update of the scene happens,
-        // because the global tranformation can only be obtained by traversing the nodes.
-        lightIndicesMap_.clear();
-        lights_.clear();
+        // because the global tranformation can only be obtained by flattening the nodes.
+        std::vector<LightPrimitiveIndex> lights;
         if (envLight_) {
-            lightIndicesMap_[*envLight_] = 0;
-            lights_.push_back({ Transform(Mat4(1_f)), *envLight_ });
+            lights.push_back({ Transform(Mat4(1_f)), *envLight_ });
         }
-        traverseNodes([&](const SceneNode& node, Mat4 globalTransform) {
-            if (node.type == SceneNodeType::Primitive && node.primitive.light) {
-                lightIndicesMap_[node.index] = int(lights_.size());
-                lights_.push_back({ Transform(globalTransform), node.index });
+        for (const auto& inst : primitiveInstances_) {
+            const auto* light = compiled_[inst.node].light;
+            if (light && !light->isInfinite()) {
+                lights.push_back({ inst.globalTransform, inst.node });
             }
-        });
+        }
+
+        // Rebuild the distributions for light selection only if the lights are affected.
+        // The power of the environment light depends on the bound of the whole scene,
+        // which is updated only for the instances whose nodes or transforms are modified.
+        const bool sameLights = lights.size() == lights_.size() &&
+            std::equal(lights.begin(), lights.end(), lights_.begin(), [](const auto& l1, const auto& l2) {
+                return l1.index == l2.index && l1.globalTransform.M == l2.globalTransform.M;
+            });
+        bool boundChanged = false;
+        if (envLight_ && lightSelection != "uniform") {
+            boundChanged = updateBounds(prevInstances, full);
+        }
+        else {
+            instanceBounds_.clear();
+            sceneBound_ = {};
+        }
+        if (full || dirtyLight || !sameLights || boundChanged) {
+            lights_ = std::move(lights);
+            buildLights(lightSelection);
+            buildReport_["lights"] = "rebuilt";
+        }
 
         // Build acceleration structure
-        accel_ = comp::create<Accel>(name, makeLoc(loc(), "accel"), prop);
-        if (!accel_) {
-            return;
+        if (full) {
+            accel_ = comp::create<Accel>(name, makeLoc(loc(), "accel"), prop);
+            if (!accel_) {
+                return;
+            }
+            LM_INFO("Building acceleration structure [name='{}']", name);
+            LM_INDENT();
+            accel_->build(*this);
+            buildReport_["accel"] = "built";
+        }
+        else {
+            LM_INFO("Updating acceleration structure [name='{}']", name);
+            LM_INDENT();
+            accel_->update(*this, dirtyNodes_);
+            buildReport_["accel"] = "updated";
         }
-        LM_INFO("Building acceleration structure [name='{}']", name);
-        LM_INDENT();
-        accel_->build(*this);
+        accelName_ = name;
+        buildProp_ = prop;
+        dirtyNodes_.clear();
+
+        LM_INFO("Built scene [full='{}', dirty_nodes='{}', lights='{}']",
+            full, buildReport_["dirty_nodes"].get<size_t>(), buildReport_["lights"].get<std::string>());
     }
 
     virtual std::optional<SceneInteraction> intersect(Ray ray, Float tmin, Float tmax) const override {
+        const auto hit = intersectHit(ray, tmin, tmax);
+        if (!hit) {
+            return {};
+        }
+        return interaction(*hit);
+    }
+
+    virtual std::optional<SceneHit> intersectHit(Ray ray, Float tmin, Float tmax) const override {
         const auto hit = accel_->intersect(ray, tmin, tmax);
         if (!hit) {
             // Use environment light when tmax = Inf
@@ -271,41 +1033,65 @@ public:
             if (!envLight_) {
                 return {};
             }
+            return SceneHit{ *envLight_, -1, Inf, {}, ray.d, true, true };
+        }
+        const auto [t, uv, globalTransform, primitiveIndex, faceIndex, instanceTransform] = *hit;
+        return SceneHit{
+            primitiveIndex,
+            faceIndex,
+            t,
+            uv,
+            ray.d,
+            false,
+            compiled_[primitiveIndex].light != nullptr,
+            globalTransform,
+            instanceTransform
+        };
+    }
+
+    virtual SceneInteraction interaction(const SceneHit& hit) const override {
+        if (hit.infinite) {
             return SceneInteraction{
-                *envLight_,
+                hit.primitive,
                 0,
-                PointGeometry::makeInfinite(-ray.d),
+                PointGeometry::makeInfinite(-hit.d),
                 true,
                 false
             };
         }
-        const auto [t, uv, globalTransform, primitiveIndex, faceIndex] = *hit;
-        const auto& primitive = nodes_.at(primitiveIndex).primitive;
-        const auto p = primitive.mesh->surfacePoint(faceIndex, uv);
+        const auto p = compiled_[hit.primitive].mesh->surfacePoint(hit.face, hit.uv);
+        auto pos = Vec3(hit.globalTransform->M * Vec4(p.p, 1_f));
+        auto n = hit.globalTransform->normalM * p.n;
+        if (hit.instanceTransform) {
+            // Transform from the local space of the instance
+            pos = Vec3(hit.instanceTransform->M * Vec4(pos, 1_f));
+            n = hit.instanceTransform->normalM * n;
+        }
         return SceneInteraction{
-            primitiveIndex,
+            hit.primitive,
             -1,
-            PointGeometry::makeOnSurface(
-                globalTransform.M * Vec4(p.p, 1_f),
-                globalTransform.normalM * p.n,
-                p.t
-            ),
+            PointGeometry::makeOnSurface(pos, n, p.t),
+            false,
             false,
-            false
+            hit.face
         };
     }
 
+    virtual bool occluded(Ray ray, Float tmin, Float tmax) const override {
+        return accel_->occluded(ray, tmin, tmax);
+    }
+
     // ------------------------------------------------------------------------
 
     virtual bool isLight(const SceneInteraction& sp) const override {
-        const auto& primitive = nodes_.at(sp.primitive).primitive;
+        const auto& primitive = compiled_[sp.primitive];
         return sp.medium
             ? primitive.medium->isEmitter()
             : primitive.light != nullptr;
     }
 
     virtual bool isSpecular(const SceneInteraction& sp) const override {
-        const auto& primitive = nodes_.at(sp.primitive).primitive;
+        const auto& primitive = compiled_[sp.primitive];
         if (sp.medium) {
             return primitive.medium->phase()->isSpecular(sp.geom);
         }
@@ -324,11 +1110,11 @@ public:
     // ------------------------------------------------------------------------
 
     virtual Ray primaryRay(Vec2 rp, Float aspectRatio) const {
-        return nodes_.at(*camera_).primitive.camera->primaryRay(rp, aspectRatio);
+        return compiled_[*camera_].camera->primaryRay(rp, aspectRatio);
     }
 
     virtual std::optional<RaySample> sampleRay(Rng& rng, const SceneInteraction& sp, Vec3 wi) const override {
-        const auto& primitive = nodes_.at(sp.primitive).primitive;
+        const auto& primitive = compiled_[sp.primitive];
         if (sp.medium) {
             // Medium interaction
             const auto s = primitive.medium->phase()->sample(rng, sp.geom, wi);
@@ -365,7 +1151,7 @@ public:
     }
 
     virtual std::optional<RaySample> samplePrimaryRay(Rng& rng, Vec4 window, Float aspectRatio) const override {
-        const auto s = nodes_.at(*camera_).primitive.camera->samplePrimaryRay(rng, window, aspectRatio);
+        const auto s = compiled_[*camera_].camera->samplePrimaryRay(rng, window, aspectRatio);
         if (!s) {
             return {};
         }
@@ -384,14 +1170,30 @@ public:
 
     virtual std::optional<RaySample> sampleLight(Rng& rng, const SceneInteraction& sp) const override {
         // Sample a light
-        const int n  = int(lights_.size());
-        const int i  = glm::clamp(int(rng.u() * n), 0, n-1);
-        const auto pL = 1_f / n;
+        if (lights_.empty()) {
+            return {};
+        }
+        int i  = lightDist_.samp(rng);
+        auto pL = lightDist_.p(i);
+
+        // Select an element in the hierarchy if the light is in the hierarchy
+        int element = -1;
+        if (lightElementOffsets_[i] >= 0) {
+            const auto e = lightTree_.sample(rng, sp.geom);
+            if (!e) {
+                return {};
+            }
+            i = elementLights_[std::get<0>(*e)];
+            element = std::get<0>(*e) - lightElementOffsets_[i];
+            pL = pTree_ * std::get<1>(*e);
+        }
         
         // Sample a position on the light
-        const auto light = lights_.at(i);
-        const auto& primitive = nodes_.at(light.index).primitive;
-        const auto s = primitive.light->sample(rng, sp.geom, light.globalTransform);
+        const auto& light = lights_[i];
+        const auto& primitive = compiled_[light.index];
+        const auto s = element >= 0
+            ? primitive.light->sampleElement(rng, sp.geom, light.globalTransform, element)
+            : primitive.light->sample(rng, sp.geom, light.globalTransform);
         if (!s) {
             return {};
         }
@@ -401,7 +1203,8 @@ public:
                 0,
                 s->geom,
                 true,
-                false
+                false,
+                element
             },
             s->wo,
             s->weight / pL
@@ -409,7 +1212,7 @@ public:
     }
     
     virtual Float pdf(const SceneInteraction& sp, Vec3 wi, Vec3 wo) const override {
-        const auto& primitive = nodes_.at(sp.primitive).primitive;
+        const auto& primitive = compiled_[sp.primitive];
         if (sp.medium) {
             return primitive.medium->phase()->pdf(sp.geom, wi, wo);
         }
@@ -419,21 +1222,30 @@ public:
     }
 
     virtual Float pdfLight(const SceneInteraction& sp, const SceneInteraction& spL, Vec3 wo) const override {
-        const auto& primitive = nodes_.at(spL.primitive).primitive;
-        const auto lightTransform = lights_.at(lightIndicesMap_.at(spL.primitive)).globalTransform;
-        const auto pL = 1_f / int(lights_.size());
+        const auto& primitive = compiled_[spL.primitive];
+        const int i = primitive.lightIndex;
+        const auto& lightTransform = lights_[i].globalTransform;
+        if (const int offset = lightElementOffsets_[i]; offset >= 0 && spL.face >= 0) {
+            // Light in the hierarchy.
+            // If the point is not associated with a face, e.g., the interaction is not made from a hit,
+            // the element is unknown and we fall back to the pdf of the light selected as a whole.
+            const auto pL = pTree_ * lightTree_.pmf(sp.geom, offset + spL.face);
+            return primitive.light->pdfElement(sp.geom, spL.geom, lightTransform, spL.face, wo) * pL;
+        }
+        const auto pL = lightDist_.p(i);
         return primitive.light->pdf(sp.geom, spL.geom, lightTransform, wo) * pL;
     }
 
     // ------------------------------------------------------------------------
 
     virtual std::optional<DistanceSample> sampleDistance(Rng& rng, const SceneInteraction& sp, Vec3 wo) const override {
-        // Intersection to next surface
-        const auto hit = intersect(Ray{ sp.geom.p, wo }, Eps, Inf);
-        const auto dist = hit ? glm::length(hit->geom.p - sp.geom.p) : Inf;
+        // Intersection to next surface.
+        // The surface interaction is computed only if the surface is sampled.
+        const auto hit = intersectHit(Ray{ sp.geom.p, wo }, Eps, Inf);
+        const auto dist = hit ? hit->t : Inf;
         
         // Sample a distance
-        const auto* medium = nodes_.at(*medium_).primitive.medium;
+        const auto* medium = compiled_[*medium_].medium;
         const auto ds = medium->sampleDistance(rng, sp.geom, wo, dist);
         assert(ds);
         
@@ -453,7 +1265,7 @@ public:
         else {
             // Surface interaction
             return DistanceSample{
-                *hit,
+                interaction(*hit),
                 ds->weight
             };
         }
@@ -466,13 +1278,13 @@ public:
         if (!medium_) {
             return Vec3(1_f);
         }
-        return nodes_.at(*medium_).primitive.medium->evalTransmittance(rng, sp1.geom, sp2.geom);
+        return compiled_[*medium_].medium->evalTransmittance(rng, sp1.geom, sp2.geom);
     }
 
     // ------------------------------------------------------------------------
 
     virtual Vec3 evalContrb(const SceneInteraction& sp, Vec3 wi, Vec3 wo) const override {
-        const auto& primitive = nodes_.at(sp.primitive).primitive;
+        const auto& primitive = compiled_[sp.primitive];
         if (sp.medium) {
             // Medium interaction
             return primitive.medium->phase()->eval(sp.geom, wi, wo);
@@ -493,7 +1305,7 @@ public:
     }
 
     virtual Vec3 evalContrbEndpoint(const SceneInteraction& sp, Vec3 wo) const override {
-        const auto& primitive = nodes_.at(sp.primitive).primitive;
+        const auto& primitive = compiled_[sp.primitive];
         if (!primitive.light) {
             return {};
         }
@@ -501,7 +1313,7 @@ public:
     }
 
     virtual std::optional<Vec3> reflectance(const SceneInteraction& sp) const override {
-        const auto& primitive = nodes_.at(sp.primitive).primitive;
+        const auto& primitive = compiled_[sp.primitive];
         if (!primitive.material) {
             return {};
         }
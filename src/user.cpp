@@ -213,6 +213,10 @@ public:
         });
     }
 
+    virtual void setTransform(int node, Mat4 transform) override {
+        scene_->setTransform(node, transform);
+    }
+
     virtual void addChild(int parent, int child) override {
         scene_->addChild(parent, child);
     }
@@ -305,6 +309,10 @@ LM_PUBLIC_API int transformNode(Mat4 transform) {
     return Instance::get().transformNode(transform);
 }
 
+LM_PUBLIC_API void setTransform(int node, Mat4 transform) {
+    Instance::get().setTransform(node, transform);
+}
+
 LM_PUBLIC_API void addChild(int parent, int child) {
     Instance::get().addChild(parent, child);
 }
@@ -0,0 +1,148 @@
+/*
+    Lightmetrica - Copyright (c) 2019 Hisanari Otsu
+    Distributed under MIT license. See LICENSE file for details.
+*/
+
+#include <pch.h>
+#include "test_common.h"
+#include <lm/user.h>
+#include <lm/scene.h>
+#include <lm/json.h>
+
+LM_NAMESPACE_BEGIN(LM_TEST_NAMESPACE)
+
+// Creates a grid of n x n quads of size h on the plane z = c.z starting from c
+lm::Json gridMesh(lm::Vec3 c, int n, lm::Float h) {
+    lm::Json ps = lm::Json::array();
+    lm::Json fs = lm::Json::array();
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            const lm::Vec3 p(c.x + i * h, c.y + j * h, c.z);
+            const lm::Vec3 vs[4] = { p, p + lm::Vec3(h, 0, 0), p + lm::Vec3(h, h, 0), p + lm::Vec3(0, h, 0) };
+            const int s = int(ps.size()) / 3;
+            for (const auto& v : vs) {
+                ps.insert(ps.end(), { v.x, v.y, v.z });
+            }
+            fs.insert(fs.end(), { s, s+1, s+2, s, s+2, s+3 });
+        }
+    }
+    const lm::Json zeros(std::vector<int>(fs.size(), 0));
+    return {
+        {"ps", ps},
+        {"ns", {0,0,1}},
+        {"ts", {0,0}},
+        {"fs", {
+            {"p", fs},
+            {"t", zeros},
+            {"n", zeros}
+        }}
+    };
+}
+
+TEST_CASE("Accel") {
+    lm::init();
+
+    SUBCASE("Single-precision mode of accel::sahbvh finds the same hits as double precision") {
+        // Small triangles far from the origin, where the vertices and the ray origins
+        // are rounded by the amount comparable to the size of the triangles in single precision.
+        const lm::Vec3 c(1e4, -1e4, 1e4);
+        const int n = 16;
+        const lm::Float h = 1e-2;
+        lm::primitive(lm::Mat4(1), {
+            {"mesh", lm::asset("mesh", "mesh::raw", gridMesh(c, n, h))}
+        });
+
+        // Rays toward random points around the grid with the origins close to the grid
+        std::mt19937 eng(42);
+        std::uniform_real_distribution<lm::Float> u;
+        std::vector<lm::Ray> rays;
+        for (int i = 0; i < 10000; i++) {
+            const lm::Vec3 o = c + lm::Vec3(u(eng), u(eng), lm::Float(0.1) + u(eng)) * (n * h);
+            const lm::Vec3 p = c + lm::Vec3(u(eng) * lm::Float(1.1) - lm::Float(0.05), u(eng) * lm::Float(1.1) - lm::Float(0.05), 0) * (n * h);
+            rays.push_back({ o, glm::normalize(p - o) });
+        }
+
+        // Find the hits with the given parameters of the accel
+        const auto trace = [&](const lm::Json& prop) {
+            lm::build("accel::sahbvh", prop);
+            const auto* scene = lm::comp::get<lm::Scene>("$.scene");
+            std::vector<std::optional<lm::SceneHit>> hits;
+            for (const auto& ray : rays) {
+                hits.push_back(scene->intersectHit(ray, 0, lm::Inf));
+            }
+            return hits;
+        };
+        const auto expected = trace({});
+        const auto hits = trace({ {"single_precision", true} });
+
+        // The hits on the shared edges might be reported by either triangle,
+        // so we compare the existence of the hits and the distances.
+        int numHits = 0;
+        for (size_t i = 0; i < rays.size(); i++) {
+            REQUIRE(bool(hits[i]) == bool(expected[i]));
+            if (expected[i]) {
+                CHECK(hits[i]->t == doctest::Approx(expected[i]->t).epsilon(1e-8));
+                numHits++;
+            }
+        }
+        CHECK(numHits > 0);
+    }
+
+    SUBCASE("Updated accel::sahbvh finds the same hits as the structure built from scratch") {
+        // Two instances of a grid under the transform nodes
+        const auto mesh = lm::asset("mesh", "mesh::raw", gridMesh(lm::Vec3(0), 8, lm::Float(0.125)));
+        const int t1 = lm::transformNode(lm::Mat4(1));
+        const int t2 = lm::transformNode(glm::translate(lm::Mat4(1), lm::Vec3(2, 0, 0)));
+        for (int t : { t1, t2 }) {
+            lm::addChild(lm::rootNode(), t);
+            lm::addChild(t, lm::primitiveNode({ {"mesh", mesh} }));
+        }
+        lm::build("accel::sahbvh", {});
+
+        // Rays from above the grids toward random points on the plane of the grids
+        std::mt19937 eng(42);
+        std::uniform_real_distribution<lm::Float> u;
+        std::vector<lm::Ray> rays;
+        for (int i = 0; i < 10000; i++) {
+            const lm::Vec3 o(u(eng) * 5 - 1, u(eng) * 3 - 1, 3);
+            const lm::Vec3 p(u(eng) * 5 - 1, u(eng) * 3 - 1, 0);
+            rays.push_back({ o, glm::normalize(p - o) });
+        }
+        const auto trace = [&]() {
+            const auto* scene = lm::comp::get<lm::Scene>("$.scene");
+            std::vector<std::optional<lm::SceneHit>> hits;
+            for (const auto& ray : rays) {
+                hits.push_back(scene->intersectHit(ray, 0, lm::Inf));
+            }
+            return hits;
+        };
+
+        // Move one of the grids and update the structure by refitting
+        lm::setTransform(t1, glm::rotate(glm::translate(lm::Mat4(1), lm::Vec3(.5, .3, .2)), lm::Float(.3), lm::Vec3(1, 1, 0)));
+        lm::build("accel::sahbvh", {});
+        const auto report = lm::comp::get<lm::Scene>("$.scene")->underlyingValue("build");
+        CHECK(report["full"] == false);
+        CHECK(report["accel"] == "updated");
+        const auto hits = trace();
+
+        // Build the structure from scratch with the different property
+        lm::build("accel::sahbvh", { {"binned", false} });
+        CHECK(lm::comp::get<lm::Scene>("$.scene")->underlyingValue("build")["full"] == true);
+        const auto expected = trace();
+
+        int numHits = 0;
+        for (size_t i = 0; i < rays.size(); i++) {
+            REQUIRE(bool(hits[i]) == bool(expected[i]));
+            if (expected[i]) {
+                CHECK(hits[i]->primitive == expected[i]->primitive);
+                CHECK(hits[i]->t == doctest::Approx(expected[i]->t).epsilon(1e-8));
+                numHits++;
+            }
+        }
+        CHECK(numHits > 0);
+    }
+
+    lm::shutdown();
+}
+
+LM_NAMESPACE_END(LM_TEST_NAMESPACE)
@@ -0,0 +1,157 @@
+/*
+    Lightmetrica - Copyright (c) 2019 Hisanari Otsu
+    Distributed under MIT license. See LICENSE file for details.
+*/
+
+#include <pch.h>
+#include "test_common.h"
+#include <lm/math.h>
+#include <lm/serial.h>
+
+LM_NAMESPACE_BEGIN(LM_TEST_NAMESPACE)
+
+// Number of samples to check the frequencies
+constexpr int NumSamples = 1000000;
+
+// Maximum absolute difference between the frequencies and the probabilities
+constexpr double FrequencyTolerance = 0.005;
+
+TEST_CASE("AliasDist") {
+    const std::vector<lm::Float> ws{ 1, 0, 3, 2, 0, 4 };
+    lm::AliasDist dist;
+    for (auto w : ws) {
+        dist.add(w);
+    }
+    dist.norm();
+
+    SUBCASE("Pmf") {
+        for (int i = 0; i < int(ws.size()); i++) {
+            CHECK(dist.p(i) == doctest::Approx(ws[i] / 10));
+        }
+        CHECK(dist.p(-1) == 0);
+        CHECK(dist.p(int(ws.size())) == 0);
+    }
+
+    SUBCASE("Frequencies of the samples match pmf") {
+        lm::Rng rng(42);
+        std::vector<int> counts(ws.size());
+        for (int i = 0; i < NumSamples; i++) {
+            counts[dist.samp(rng)]++;
+        }
+        for (int i = 0; i < int(ws.size()); i++) {
+            if (ws[i] == 0) {
+                CHECK(counts[i] == 0);
+            }
+            CHECK(std::abs(double(counts[i]) / NumSamples - dist.p(i)) < FrequencyTolerance);
+        }
+    }
+
+    SUBCASE("Uniform distribution if the sum is zero") {
+        lm::AliasDist zero;
+        for (int i = 0; i < 4; i++) {
+            zero.add(0);
+        }
+        zero.norm();
+        for (int i = 0; i < 4; i++) {
+            CHECK(zero.p(i) == doctest::Approx(0.25));
+        }
+    }
+
+    SUBCASE("Compatible with the archives of Dist") {
+        lm::Dist orig;
+        for (auto w : ws) {
+            orig.add(w);
+        }
+        orig.norm();
+        std::stringstream ss;
+        lm::serial::save(ss, orig);
+        lm::AliasDist loaded;
+        lm::serial::load(ss, loaded);
+        for (int i = 0; i < int(ws.size()); i++) {
+            CHECK(loaded.p(i) == doctest::Approx(orig.p(i)));
+        }
+
+        std::stringstream ss2;
+        lm::serial::save(ss2, dist);
+        lm::Dist loaded2;
+        lm::serial::load(ss2, loaded2);
+        for (int i = 0; i < int(ws.size()); i++) {
+            CHECK(loaded2.p(i) == doctest::Approx(dist.p(i)));
+        }
+    }
+}
+
+TEST_CASE("AliasDist2") {
+    // The second row has zero weights
+    const int w = 4;
+    const int h = 3;
+    const std::vector<lm::Float> ws{
+        1, 2, 0, 1,
+        0, 0, 0, 0,
+        3, 1, 1, 2
+    };
+    lm::AliasDist2 dist;
+    dist.init(ws, w, h);
+
+    // Pmf of the cell evaluated at the center
+    const auto pmf = [&](const auto& d, int x, int y) {
+        return d.p((x + .5) / w, (y + .5) / h) / (w * h);
+    };
+
+    SUBCASE("Pmf") {
+        for (int y = 0; y < h; y++) {
+            for (int x = 0; x < w; x++) {
+                CHECK(pmf(dist, x, y) == doctest::Approx(ws[y * w + x] / 11));
+            }
+        }
+    }
+
+    SUBCASE("Frequencies of the samples match pmf") {
+        lm::Rng rng(42);
+        std::vector<int> counts(w * h);
+        for (int i = 0; i < NumSamples; i++) {
+            const auto u = dist.samp(rng);
+            const int x = std::min(int(u.x * w), w - 1);
+            const int y = std::min(int(u.y * h), h - 1);
+            counts[y * w + x]++;
+        }
+        for (int y = 0; y < h; y++) {
+            for (int x = 0; x < w; x++) {
+                const int i = y * w + x;
+                if (ws[i] == 0) {
+                    CHECK(counts[i] == 0);
+                }
+                CHECK(std::abs(double(counts[i]) / NumSamples - pmf(dist, x, y)) < FrequencyTolerance);
+            }
+        }
+    }
+
+    SUBCASE("Compatible with the archives of Dist2") {
+        // Dist2 does not support the rows with zero weights
+        auto ws2 = ws;
+        std::fill(ws2.begin() + w, ws2.begin() + 2 * w, lm::Float(1));
+        lm::Dist2 orig;
+        orig.init(ws2, w, h);
+        std::stringstream ss;
+        lm::serial::save(ss, orig);
+        lm::AliasDist2 loaded;
+        lm::serial::load(ss, loaded);
+        for (int y = 0; y < h; y++) {
+            for (int x = 0; x < w; x++) {
+                CHECK(pmf(loaded, x, y) == doctest::Approx(pmf(orig, x, y)));
+            }
+        }
+
+        std::stringstream ss2;
+        lm::serial::save(ss2, dist);
+        lm::Dist2 loaded2;
+        lm::serial::load(ss2, loaded2);
+        for (int y = 0; y < h; y++) {
+            for (int x = 0; x < w; x++) {
+                CHECK(pmf(loaded2, x, y) == doctest::Approx(pmf(dist, x, y)));
+            }
+        }
+    }
+}
+
+LM_NAMESPACE_END(LM_TEST_NAMESPACE)